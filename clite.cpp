@@ -6,17 +6,27 @@
 
 #include <cctype>
 #include <cerrno>
+#include <climits>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <iostream>
 #include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 /*** defines ***/
@@ -24,6 +34,17 @@
 #define CLITE_VERSION "0.0.1"
 #define CLITE_TAB_STOP 8
 #define CLITE_QUIT_TIMES 3
+#define CLITE_HL_IDLE_ROWS 1024
+#define CLITE_HL_CHUNK_ROWS 1024
+#define CLITE_HL_MAX_THREADS 64
+#define CLITE_HL_CACHE_ENTRIES 4096
+#define CLITE_HL_CACHE_MAX_ROW 4096
+#define CLITE_HL_RESUME_GAP 256
+#define CLITE_LONG_ROW (1<<20)
+#define CLITE_LONG_ROW_SEGMENT 65536
+#define CLITE_DIFF_GAP 4
+#define CLITE_FRAME_MS 16
+#define CLITE_ACK_MS 1000
 
 // Clear upper 3 bits of 'k', similar to Ctrl behavior in terminal
 #define CTRL_KEY(k) ((k) & 0x01f)
@@ -40,7 +61,9 @@ enum editorKey
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_START, // Start of text pasted in bracketed paste mode
+	STATUS_REPORT // Terminal's answer to a request, taken in where it is read
 };
 
 // Enum for highlighting types
@@ -59,19 +82,105 @@ enum editorHighlight
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// Lexer states carried from one character to the next
+enum editorLexState
+{
+	LS_SEPARATOR = 0, // Normal text, previous character was a separator
+	LS_NORMAL, // Normal text, previous character was not a separator
+	LS_NUMBER, // Previous character was part of a number
+	LS_STRING_DQ, // Inside a "string"
+	LS_STRING_SQ, // Inside a 'string'
+	LS_COMMENT, // Inside a multi-line comment
+	LS_STATES
+};
+
+// Lexer table entries: highlight in bits 0-3, next state in bits 4-7 and
+// flags for the transitions that need more than one character
+#define LEX_HL(t) ((t) & 0x0f)
+#define LEX_NEXT(t) (((t) >> 4) & 0x0f)
+#define LEX_ENTRY(hl, next) ((hl) | ((next) << 4))
+#define LEX_DELIM (1<<8) // May start a comment delimiter
+#define LEX_KEYWORD (1<<9) // May start a keyword
+#define LEX_ESCAPE (1<<10) // Escapes the next character in a string
+
+// Character classes used by the highlighter
+#define CC_SEPARATOR (1<<0)
+#define CC_DIGIT (1<<1)
+#define CC_QUOTE (1<<2)
+#define CC_IDENT (1<<3)
+
+// Screen cell attributes: foreground color as an offset from 30, 0 for the
+// default color, and inverse video
+#define ATTR_COLOR(a) ((a) & 0x0f)
+#define ATTR_INVERSE 0x10
+
+// Kinds of brackets tracked for matching: (), [] and {}
+#define BRACKET_KINDS 3
+
+// Keyword hash table size (power of two) and space for the keyword text
+#define CLITE_KW_SLOTS 512
+#define CLITE_KW_POOL 4096
+
 
 /*** data ***/
 
+// A keyword in a keyword table, `len` of 0 marks an empty slot
+struct editorKeyword
+{
+	unsigned short off; // Offset of the keyword text in the pool
+	unsigned char len;
+	unsigned char hl; // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+// Open addressing hash table of keywords, built at compile time so that an
+// identifier is looked up with one hash over its characters
+struct editorKeywordSet
+{
+	editorKeyword slot[CLITE_KW_SLOTS];
+	char pool[CLITE_KW_POOL];
+};
+
+// State transition table compiled from an editorSyntax, indexed by the
+// current lexer state and the next byte
+struct editorLexTable
+{
+	unsigned short t[LS_STATES][256];
+};
+
 // Syntax highlighting information for a particular filetype
 struct editorSyntax
 {
 	const char *filetype;
 	const char **filematch;
-	const char **keywords;
+	const editorKeywordSet *keywords;
 	const char *singleline_comment_start;
 	const char *multiline_comment_start;
 	const char *multiline_comment_end;
 	int flags;
+	const editorLexTable *lexer; // Compiled by editorCompileSyntax() at startup
+};
+
+// Bracket nesting of some text for one kind of bracket, counting only those
+// outside strings and comments
+struct editorBracketSum
+{
+	int sum; // Opening minus closing brackets
+	int low; // Lowest nesting reached reading forwards from 0, at most 0
+	int back_low; // Same reading backwards, where closing brackets open
+};
+
+// Lexer state at a position within a row, where lexing can resume
+struct editorLexResume
+{
+	int pos;
+	int state;
+};
+
+// A tab within a row: its character index and the render column after it
+struct editorTab
+{
+	int cx;
+	int rx;
 };
 
 // erow - Editor row
@@ -80,11 +189,22 @@ struct erow
 {
 	int idx; // Row's index within the file
 	int size; // Number of characters in the row
-	int rsize; // Number of characters in the render (with formatting)
 	char *chars; // The raw characters in the row
-	char *render; // The formatted (rendered) text
-	unsigned char *hl; // Array to store highlighting info for each character
+	unsigned char *hl; // Highlight spans over `chars`, see editorStoreHighlight()
+	int hl_len; // Number of bytes used by the encoded spans in `hl`
 	int hl_open_comment; // Flag to track if this row is in an open multi-line cmt
+	editorLexResume *hl_resume; // Lexer states saved along long rows
+	int hl_nresume;
+	// Range of characters edited since the row was last highlighted, -1 if
+	// none, and by how much its size changed
+	int hl_dirty_from, hl_dirty_to, hl_dirty_delta;
+	// Characters highlighted in a long row, see editorLexSegment()
+	int hl_seg_from, hl_seg_to;
+	// Nesting of each kind of bracket in the row, from its highlighting
+	editorBracketSum brackets[BRACKET_KINDS];
+	unsigned long stamp; // Changes with what the row draws, see editorRowChanged()
+	editorTab *tabs; // The row's tabs in order, see editorRowTabsEdit()
+	int ntabs;
 };
 
 struct editorConfig
@@ -98,6 +218,10 @@ struct editorConfig
 	int numrows;
 	erow *row;
 	int dirty;
+	int hl_valid; // Rows below this index carry up-to-date highlighting
+	int hl_stale_end; // Rows from here on are consistent with each other
+	int hl_threads; // Number of threads used to highlight large ranges of rows
+	int long_row; // Rows longer than this are only highlighted around the screen
 	char *filename;
 	char statusmsg[80];
 	time_t statusmsg_time;
@@ -107,6 +231,46 @@ struct editorConfig
 
 struct editorConfig E;
 
+// Counters shown by editorShowStats()
+struct editorStats
+{
+	unsigned long hl_cache_hits;
+	unsigned long hl_cache_misses;
+	unsigned long frames; // Screen refreshes
+	unsigned long frames_skipped; // Refreshes skipped while the terminal was busy
+	unsigned long writes; // write() calls sending frames
+	unsigned long ab_allocs; // Append buffer (re)allocations, see abReserve()
+};
+
+struct editorStats ST;
+
+// Node of the bracket tree, one per row, holding the nesting of the row and
+// of its whole subtree for each kind of bracket
+struct editorBracketNode
+{
+	editorBracketSum row[BRACKET_KINDS];
+	editorBracketSum sub[BRACKET_KINDS];
+	int size; // Rows in the subtree
+	int left, right; // Children, 0 for none
+	unsigned int prio; // Random, higher than the children's, keeps the tree balanced
+};
+
+// Balanced tree over the rows' bracket nesting in file order (a treap keyed
+// by row position), so a matching bracket is found by skipping whole ranges
+// of rows that cannot contain it. Rows inserted or deleted are spliced in and
+// out, and a row's nesting is updated along the path above it
+struct editorBracketTree
+{
+	editorBracketNode *node; // Node 0 stands for "none" and stays empty
+	int cap, used;
+	int free; // Unused nodes, chained through `left`
+	int root;
+	int valid; // Set once the rows have been put in the tree
+	unsigned int seed; // State of the generator of priorities
+};
+
+struct editorBracketTree BT;
+
 
 /*** filetypes ***/
 
@@ -115,14 +279,46 @@ const char *C_HL_extensions[] = { ".c", ".h", NULL };
 const char *CPP_HL_extensions[] = { ".C", ".cc", ".cp", ".cpp", ".cxx", ".c++", NULL };
 const char *JAVA_HL_extensions[] = { ".java", NULL };
 
-const char *C_HL_keywords[] = { "auto", "break", "case", "const", "continue", 
+// FNV-1a hash of an identifier, used to index the keyword tables
+constexpr unsigned int editorHashKeyword(const char *s, int len)
+{
+	unsigned int h = 2166136261u;
+	for (int i = 0; i < len; i++) h = (h ^ (unsigned char) s[i]) * 16777619u;
+	return h;
+}
+
+// Build a keyword table from a NULL terminated list, where keywords ending in
+// '|' are secondary keywords (types)
+constexpr editorKeywordSet editorBuildKeywordSet(const char *const *keywords)
+{
+	editorKeywordSet set = {};
+	int used = 0;
+	for (int j = 0; keywords[j]; j++) {
+		int klen = 0;
+		while (keywords[j][klen]) klen++;
+		int kw2 = keywords[j][klen - 1] == '|';
+		if (kw2) klen--;
+
+		// Linear probing to the next free slot
+		unsigned int h = editorHashKeyword(keywords[j], klen) & (CLITE_KW_SLOTS - 1);
+		while (set.slot[h].len) h = (h + 1) & (CLITE_KW_SLOTS - 1);
+
+		set.slot[h].off = used;
+		set.slot[h].len = klen;
+		set.slot[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+		for (int k = 0; k < klen; k++) set.pool[used++] = keywords[j][k];
+	}
+	return set;
+}
+
+constexpr const char *C_HL_keywords[] = { "auto", "break", "case", "const", "continue", 
 	"default", "do", "else", "enum", "extern", "for", "goto", "if", "register", 
 	"return", "short", "sizeof", "static", "struct", "switch", "typedef", 
 	"union", "unsigned", "volatile", "while", 
 	"char|", "double|", "float|", "int|", "long|", "signed|", "void|", NULL 
 };
 
-const char *CPP_HL_keywords[] = { "alignas", "alignof", "and", "and_eq", "asm", 
+constexpr const char *CPP_HL_keywords[] = { "alignas", "alignof", "and", "and_eq", "asm", 
 	"auto", "bitand", "bitor", "break", "case", "catch", "class", "compl", 
 	"const", "constexpr", "const_cast", "continue", "decltype", "default", 
 	"delete", "do", "dynamic_cast", "else", "enum", "explicit", "export", 
@@ -137,7 +333,7 @@ const char *CPP_HL_keywords[] = { "alignas", "alignof", "and", "and_eq", "asm",
 	"long|", "short|", "signed|", "unsigned|", "void|", "wchar_t|", NULL 
 };
 
-const char *JAVA_HL_keywords[] = {
+constexpr const char *JAVA_HL_keywords[] = {
 	"abstract", "assert", "break", "case", "catch",
 	"class", "continue", "default", "do", "else",
 	"enum", "extends", "final", "finally", "for",
@@ -150,34 +346,41 @@ const char *JAVA_HL_keywords[] = {
 	"int|", "long|", "short|", "void|", NULL
 };
 
+constexpr editorKeywordSet C_HL_keywordset = editorBuildKeywordSet(C_HL_keywords);
+constexpr editorKeywordSet CPP_HL_keywordset = editorBuildKeywordSet(CPP_HL_keywords);
+constexpr editorKeywordSet JAVA_HL_keywordset = editorBuildKeywordSet(JAVA_HL_keywords);
+
 // HLDB - Highlight Database
 struct editorSyntax HLDB[] = {
 	{
 		"c",
 		C_HL_extensions,
-		C_HL_keywords,
+		&C_HL_keywordset,
 		"//",
 		"/*",
 		"*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		NULL
 	},
 	{
 		"c++",
 		CPP_HL_extensions,
-		CPP_HL_keywords,
+		&CPP_HL_keywordset,
 		"//",
 		"/*",
 		"*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		NULL
 	},
 	{
 		"java",
 		JAVA_HL_extensions,
-		JAVA_HL_keywords,
+		&JAVA_HL_keywordset,
 		"//",
 		"/*",
 		"*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		NULL
 	},
 
 };
@@ -185,11 +388,41 @@ struct editorSyntax HLDB[] = {
 // Constant to store the length of the HLDB array
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// A filematch pattern and the syntax it selects
+struct editorFileType
+{
+	const char *pattern;
+	struct editorSyntax *syntax;
+};
+
+// File type lookup built from HLDB and the syntax files: extensions live in a
+// hash table, other patterns (matched anywhere in the filename) in a list
+struct editorFileTypes
+{
+	editorFileType *ext; // Open addressing table keyed by extension
+	int ext_slots; // Power of two
+	int ext_count;
+	editorFileType *other;
+	int other_count;
+};
+
+struct editorFileTypes FT;
+
 
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+int editorSyntaxIdle();
+int editorRowRxToCx(erow *row, int rx);
+void editorRowTabsEdit(erow *row, int at, int delta);
+void editorBracketUpdateRow(erow *row);
+void editorBracketTreeSplice(int at, int old, int n);
+void editorBracketTreeSet(int at);
 void editorRefreshScreen();
+int editorScreenWait();
+void editorScreenAck();
+void editorScreenModeReport(int mode, int state);
+void editorScreenDrain();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
 
@@ -197,7 +430,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
 void die(const char *s)
 {
-	// Clear the screen and reposition the cursor on exit
+	// Clear the screen and reposition the cursor on exit, after whatever is
+	// still on its way to the terminal (unless dying while waiting for it)
+	static int dying = 0;
+	if (!dying++) editorScreenDrain();
 	write(STDOUT_FILENO, "\x1b[2J", 4);
 	write(STDOUT_FILENO, "\x1b[H", 3);
 
@@ -218,6 +454,8 @@ void disableRawMode()
 	// tcsetattr() returns -1 on failure, handle that using die()
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
 		die("tcsetattr");
+	// Turn bracketed paste mode back off
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 }
 
 void enableRawMode()
@@ -267,15 +505,73 @@ void enableRawMode()
 	// to terminal and discards any input that hasn't been read
 	// tcsetattr() returns -1 on failure, handle that using die()
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+	// Turn on bracketed paste mode with "\x1b[?2004h", so pasted text arrives
+	// between "\x1b[200~" and "\x1b[201~" and is inserted in one go
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-// Wait for one keypress and return it
-int editorReadKey()
+// Input read from the terminal but not handled yet; reading it in blocks
+// takes one system call for a whole paste rather than one per byte
+struct editorInput
+{
+	char buf[4096];
+	int pos, len;
+};
+
+struct editorInput IN;
+
+// Refill the empty input buffer, waiting at most the read() timeout; returns
+// what read() did
+int editorFillInput()
+{
+	int nread = read(STDIN_FILENO, IN.buf, sizeof(IN.buf));
+	if (nread <= 0) return nread;
+	IN.pos = 0;
+	IN.len = nread;
+	return nread;
+}
+
+// Read one byte of input, waiting at most the read() timeout; returns what
+// read() did when nothing is buffered
+int editorReadByte(char *c)
+{
+	if (IN.pos == IN.len) {
+		int nread = editorFillInput();
+		if (nread <= 0) return nread;
+	}
+	*c = IN.buf[IN.pos++];
+	return 1;
+}
+
+// Check whether input is waiting to be read, without blocking
+int editorInputPending()
+{
+	if (IN.pos < IN.len) return 1;
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	return poll(&pfd, 1, 0) > 0;
+}
+
+// Milliseconds on a clock that only moves forwards, for pacing refreshes
+long editorNowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Wait for the next key or answer from the terminal and return it
+int editorReadInput()
 {
 	int nread;
 	char c;
-	// Ignore return value of read() other than 1 i.e. single keypress
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+	while (1) {
+		// A frame the terminal hasn't taken yet is sent as it makes room
+		if (editorScreenWait()) continue;
+		// While no key is waiting, spend the time highlighting stale rows
+		if (!editorInputPending() && editorSyntaxIdle()) continue;
+		// Ignore return value of read() other than 1 i.e. single keypress
+		if ((nread = editorReadByte(&c)) == 1) break;
 		// In Cygwin, read() returns -1 on timeout with EAGAIN, not treated as error
 		if (nread == -1 && errno != EAGAIN) die("read");
 	}
@@ -285,24 +581,55 @@ int editorReadKey()
 		// 'seq' buffer is 3 bytes long to support longer escape sequences in future
 		char seq[3];
 		// Try to read two more bytes, if reads time out then assume user pressed Esc
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+		if (editorReadByte(&seq[0]) != 1) return '\x1b';
+		// Another escape starts the next key or answer, this one was Esc alone
+		if (seq[0] == '\x1b') {
+			IN.pos--;
+			return '\x1b';
+		}
+		if (editorReadByte(&seq[1]) != 1) return '\x1b';
 
 		// If the first byte is '[' then it's an escape sequence
 		if (seq[0] == '[') {
-			// Handle Page Up/Down keys (<esc>[5~ / <esc>[6~)
+			// Answer to the mode query sent at startup, "\x1b[?<mode>;<state>$y"
+			if (seq[1] == '?') {
+				char buf[16];
+				unsigned int i = 0;
+				while (i < sizeof(buf) - 1 && editorReadByte(&buf[i]) == 1 && buf[i] != 'y') i++;
+				buf[i] = '\0';
+				int mode, state;
+				if (sscanf(buf, "%d;%d$", &mode, &state) == 2) editorScreenModeReport(mode, state);
+				return STATUS_REPORT;
+			}
+			// Keys and answers with a numeric parameter, "\x1b[<n>~" / "\x1b[<n>n"
 			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-				// Check for '~' at the end of the escape sequence to confirm PAGE UP/DOWN
-				if (seq[2] == '~') {
-					switch (seq[1]) {
-						case '1': return HOME_KEY;
-						case '3': return DEL_KEY;
-						case '4': return END_KEY;
-						case '5': return PAGE_UP;
-						case '6': return PAGE_DOWN;
-						case '7': return HOME_KEY;
-						case '8': return END_KEY;
+				// Read the whole parameter up to the final byte, so that a
+				// sequence we don't know (F9 is "\x1b[20~") is taken in whole
+				int param = seq[1] - '0', plain = 1;
+				char f;
+				while (1) {
+					if (editorReadByte(&f) != 1) return '\x1b';
+					if (f < 0x20 || f > 0x3f) break;
+					if (f < '0' || f > '9') plain = 0;
+					else if (param < 10000) param = param * 10 + f - '0';
+				}
+				// Parameters with modifiers ("\x1b[1;5C") aren't keys we handle
+				if (!plain) return '\x1b';
+				if (f == 'n' && param == 0) {
+					editorScreenAck();
+					return STATUS_REPORT;
+				}
+				if (f == '~') {
+					switch (param) {
+						case 1: return HOME_KEY;
+						case 3: return DEL_KEY;
+						case 4: return END_KEY;
+						case 5: return PAGE_UP;
+						case 6: return PAGE_DOWN;
+						case 7: return HOME_KEY;
+						case 8: return END_KEY;
+						// Pasted text starts with "\x1b[200~"
+						case 200: return PASTE_START;
 					}
 				}
 			} else {
@@ -330,6 +657,35 @@ int editorReadKey()
 	}
 }
 
+// Wait for one keypress and return it, taking in the terminal's answers on
+// the way
+int editorReadKey()
+{
+	int c;
+	while ((c = editorReadInput()) == STATUS_REPORT);
+	return c;
+}
+
+// Check whether a key is waiting, taking in answers from the terminal that
+// come before it, which aren't keys
+int editorKeyPending()
+{
+	while (editorInputPending()) {
+		if (IN.pos == IN.len && editorFillInput() <= 0) return 0;
+		// Answers start with "\x1b[0n" or "\x1b[?", keys never do
+		const char *p = &IN.buf[IN.pos];
+		int n = IN.len - IN.pos;
+		const char *answer = (n >= 3 && p[2] == '?') ? "\x1b[?" : "\x1b[0n";
+		int alen = strlen(answer);
+		if (memcmp(p, answer, n < alen ? n : alen)) return 1;
+		// Only part of what may be an answer is in; leave it for the key
+		// reader rather than wait for the rest here
+		if (n < alen) return 0;
+		editorReadInput();
+	}
+	return 0;
+}
+
 int getCursorPosition(int *rows, int *cols)
 {
 	char buf[32];
@@ -376,357 +732,1288 @@ int getWindowSize(int *rows, int *cols)
 
 /*** syntax highlighting ***/
 
-int is_separator(int c)
+// Class of every byte value, so the highlighter needs a single table lookup
+// per character instead of isspace()/strchr()/isdigit() calls
+struct editorCharClassTable
 {
-	// strchr() finds the first occurrence of `c` in the string
-	// Returns a pointer to the character or NULL if not found.
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
+	unsigned char cls[256];
+};
 
-void editorUpdateSyntax(erow *row)
+constexpr editorCharClassTable editorBuildCharClass()
 {
-	// Reallocate `hl` to match `render` size (`rsize`)
-	row->hl = (unsigned char*) realloc(row->hl, row->rsize);
-	// Set all `hl` values to HL_NORMAL (default)
-	memset(row->hl, HL_NORMAL, row->rsize);
-
-	if (E.syntax == NULL) return;
-
-	const char **keywords = E.syntax->keywords;
+	editorCharClassTable t = {};
+	const char *seps = " \t\n\v\f\r,.()+-/*=~%<>[];";
+	for (int j = 0; seps[j]; j++) t.cls[(unsigned char) seps[j]] |= CC_SEPARATOR;
+	t.cls[0] |= CC_SEPARATOR;
+	for (int c = '0'; c <= '9'; c++) t.cls[c] |= CC_DIGIT | CC_IDENT;
+	for (int c = 'a'; c <= 'z'; c++) t.cls[c] |= CC_IDENT;
+	for (int c = 'A'; c <= 'Z'; c++) t.cls[c] |= CC_IDENT;
+	// Bytes of multibyte UTF-8 sequences are treated as identifier characters
+	for (int c = 0x80; c <= 0xff; c++) t.cls[c] |= CC_IDENT;
+	t.cls[(unsigned char) '_'] |= CC_IDENT;
+	t.cls[(unsigned char) '"'] |= CC_QUOTE;
+	t.cls[(unsigned char) '\''] |= CC_QUOTE;
+	return t;
+}
 
-	// Alias for easier access to single-line comment start pattern
-	const char *scs = E.syntax->singleline_comment_start;
-	const char *mcs = E.syntax->multiline_comment_start;
-	const char *mce = E.syntax->multiline_comment_end;
+constexpr editorCharClassTable CHAR_CLASS = editorBuildCharClass();
 
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
+inline int charClass(char c)
+{
+	return CHAR_CLASS.cls[(unsigned char) c];
+}
 
-	// Assume the beginning of the line is a separator
-	int prev_sep = 1;
+int is_separator(int c)
+{
+	return charClass(c) & CC_SEPARATOR;
+}
 
-	int in_string = 0;
+// Return the length of the run of identifier characters at the start of
+// s[0..len), classifying 16 bytes at a time where SSE2 is available
+int editorIdentSpan(const char *s, int len)
+{
+	int i = 0;
+#ifdef __SSE2__
+	// Shift the ranges a-z and 0-9 to the bottom of the signed byte range, so a
+	// single signed compare checks each of them
+	const __m128i alpha_bias = _mm_set1_epi8((char) (0x80 - 'a'));
+	const __m128i alpha_max = _mm_set1_epi8((char) (0x80 + 26));
+	const __m128i digit_bias = _mm_set1_epi8((char) (0x80 - '0'));
+	const __m128i digit_max = _mm_set1_epi8((char) (0x80 + 10));
+	while (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+		__m128i alpha = _mm_cmplt_epi8(_mm_add_epi8(lower, alpha_bias), alpha_max);
+		__m128i digit = _mm_cmplt_epi8(_mm_add_epi8(v, digit_bias), digit_max);
+		__m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+		__m128i high = _mm_cmplt_epi8(v, _mm_setzero_si128());
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit),
+					_mm_or_si128(under, high)));
+		// The first clear bit is the first non-identifier byte
+		if (mask != 0xffff) return i + __builtin_ctz(~mask);
+		i += 16;
+	}
+#endif
+	while (i < len && (charClass(s[i]) & CC_IDENT)) i++;
+	return i;
+}
 
-	// Check if we're inside a multi-line comment (based on the previous row's state)
-	int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+// Look up the identifier s[0..len) in a keyword table; returns its highlight
+// type, or HL_NORMAL if it is not a keyword
+int editorKeywordLookup(const editorKeywordSet *set, const char *s, int len)
+{
+	if (len == 0 || len > 255) return HL_NORMAL;
+	unsigned int h = editorHashKeyword(s, len) & (CLITE_KW_SLOTS - 1);
+	// Probe until an empty slot, comparing only keywords of the same length
+	while (set->slot[h].len) {
+		const editorKeyword *kw = &set->slot[h];
+		if (kw->len == len && !memcmp(&set->pool[kw->off], s, len)) return kw->hl;
+		h = (h + 1) & (CLITE_KW_SLOTS - 1);
+	}
+	return HL_NORMAL;
+}
 
-	int i = 0;
-	// Use a while loop for future flexibility (e.g., multi-char patterns)
-	while (i < row->rsize) {
-		char c = row->render[i];
-		// Get the highlight type of the previous character
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-		// Highlight single-line comments if applicable
-		// If not inside multi-line comment or string
-		if (scs_len && !in_string && !in_comment) {
-			// Check if we encounter the start of a single-line comment
-			if (!strncmp(&row->render[i], scs, scs_len)) {
-				// Highlight the rest of the line
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				// End highlighting for the line
-				break;
+// Compile the lexer table for a syntax, so highlighting a row is one table
+// lookup per byte with a check of the full delimiters only at the few bytes
+// that can start one
+void editorCompileSyntax(struct editorSyntax *syntax)
+{
+	editorLexTable *lx = (editorLexTable*) malloc(sizeof(editorLexTable));
+	if (lx == NULL) die("malloc");
+
+	const char *scs = syntax->singleline_comment_start;
+	const char *mcs = syntax->multiline_comment_start;
+	const char *mce = syntax->multiline_comment_end;
+	int has_scs = scs && scs[0];
+	int has_mc = mcs && mcs[0] && mce && mce[0];
+
+	for (int b = 0; b < 256; b++) {
+		int cls = CHAR_CLASS.cls[b];
+
+		// Normal text, where the previous character decides numbers and keywords
+		for (int state = LS_SEPARATOR; state <= LS_NUMBER; state++) {
+			unsigned short t = LEX_ENTRY(HL_NORMAL,
+					(cls & CC_SEPARATOR) ? LS_SEPARATOR : LS_NORMAL);
+			if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && (cls & CC_QUOTE)) {
+				t = LEX_ENTRY(HL_STRING, b == '"' ? LS_STRING_DQ : LS_STRING_SQ);
+			} else if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) &&
+					(((cls & CC_DIGIT) && state != LS_NORMAL) ||
+					(b == '.' && state == LS_NUMBER))) {
+				t = LEX_ENTRY(HL_NUMBER, LS_NUMBER);
+			} else if (state == LS_SEPARATOR && (cls & CC_IDENT)) {
+				t |= LEX_KEYWORD;
 			}
+			if ((has_scs && b == (unsigned char) scs[0]) ||
+					(has_mc && b == (unsigned char) mcs[0]))
+				t |= LEX_DELIM;
+			lx->t[state][b] = t;
 		}
 
-		// Highlight multi-line comments if applicable
-		if (mcs_len && mce_len && !in_string) {
-			// We're inside a multi-line comment (in_comment == 1)
-			if (in_comment) {
-				// Highlight the current character as part of the multi-line comment
-				row->hl[i] = HL_MLCOMMENT;
-				// Check if we've encountered the end of the multi-line comment (mce)
-				if (!strncmp(&row->render[i], mce, mce_len)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					// Mark as separator after comment ends
-					prev_sep = 1;
-					continue;
-				} else {
-					// Still inside the comment, move to the next character
-					i++;
-					continue;
-				}
-			}
-			// We're outside a comment & we're encountering the start of a multi-line cmt
-			else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
-			}
+		// Strings end at the matching quote; the closing quote is a separator
+		for (int state = LS_STRING_DQ; state <= LS_STRING_SQ; state++) {
+			int quote = (state == LS_STRING_DQ) ? '"' : '\'';
+			unsigned short t = LEX_ENTRY(HL_STRING, b == quote ? LS_SEPARATOR : state);
+			if (b == '\\') t |= LEX_ESCAPE;
+			lx->t[state][b] = t;
 		}
 
-		// Handle string highlighting if enabled
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				// Highlight character as part of a string
-				row->hl[i] = HL_STRING;
-				// Handle escaped quotes inside strings (e.g., \" or \')
-				if (c == '\\' && i + 1 < row->rsize) {
-					// Highlight the character after the backslash
-					row->hl[i + 1] = HL_STRING;
-					// Consume both characters
-					i += 2;
-					continue;
-				}
-				// End string if the closing quote is found
-				if (c == in_string) in_string = 0;
-				i++;
-				// Closing quote is considered a separator
-				prev_sep = 1;
-				continue;
-			} else {
-				// Start string if we encounter a quote (single or double)
-				if (c == '"' || c == '\'') {
-					// Store the type of quote
-					in_string = c;
-					// Highlight the opening quote
-					row->hl[i] = HL_STRING;
-					i++;
-					continue;
-				}
-			}
-		}
+		unsigned short t = LEX_ENTRY(HL_MLCOMMENT, LS_COMMENT);
+		if (has_mc && b == (unsigned char) mce[0]) t |= LEX_DELIM;
+		lx->t[LS_COMMENT][b] = t;
+	}
 
-		// Handle number highlighting if enabled
-		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			// If current char is a digit and the previous character is a separator
-			// or part of a number (prev_hl == HL_NUMBER), or a dot (.) after a number
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-					(c == '.' && prev_hl == HL_NUMBER)) {
-				row->hl[i] = HL_NUMBER;
-				i++;
-				// Inside a number, not a separator.
-				prev_sep = 0;
-				continue;
-			}
-		}
+	syntax->lexer = lx;
+}
 
-		// Keyword Highlighting
-		if (prev_sep) {
-			int j;
-			for (j = 0; keywords[j]; j++) {
-				int klen = strlen(keywords[j]);
-				// Check if the keyword is secondary (ends with '|')
-				int kw2 = keywords[j][klen - 1] == '|';
-				// Adjust length for secondary keywords
-				if (kw2) klen--;
-
-				// Check if the current substring matches the keyword
-				if (!strncmp(&row->render[i], keywords[j], klen) &&
-						is_separator(row->render[i + klen])) {
-					// Highlight the keyword with the appropriate color
-					memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					// Consume the entire keyword
-					i += klen;
-					break;
-				}
-			}
+// Rows store their highlighting as spans of characters with the same class,
+// one byte per span holding the class in the top 3 bits and the length in
+// the low 5; a length of 0 means the real length follows as a varint
+#define HL_SPAN_CLASS(b) ((b) >> 5)
+#define HL_SPAN_SHORT 31
 
-			// If a keyword was found, continue to the next iteration of the loop
-			if (keywords[j] != NULL) {
-				// Inside a keyword, not a separator anymore
-				prev_sep = 0;
-				continue;
-			}
-		}
+// Per-character highlight buffer the lexer works in before the result is
+// encoded; one per thread, since rows are highlighted in parallel
+static thread_local unsigned char *hl_scratch = NULL;
+static thread_local int hl_scratch_cap = 0;
 
-		// Mark separator and move to the next character
-		prev_sep = is_separator(c);
-		i++;
+unsigned char *editorHighlightScratch(int size)
+{
+	if (size > hl_scratch_cap) {
+		hl_scratch_cap = size > 2 * hl_scratch_cap ? size : 2 * hl_scratch_cap;
+		hl_scratch = (unsigned char*) realloc(hl_scratch, hl_scratch_cap);
+		if (hl_scratch == NULL) die("realloc");
 	}
+	return hl_scratch;
+}
 
-	// Track if the multi-line comment state has changed
-	int changed = (row->hl_open_comment != in_comment);
-	// Set the current row's multi-line comment state = in_comment's last state
-	row->hl_open_comment = in_comment;
-	// If the state has changed and there is a next row, update its syntax
-	if (changed && row->idx + 1 < E.numrows)
-		editorUpdateSyntax(&E.row[row->idx + 1]);
+// Free the calling thread's buffer, before a highlighting worker exits
+void editorFreeHighlightScratch()
+{
+	free(hl_scratch);
+	hl_scratch = NULL;
+	hl_scratch_cap = 0;
 }
 
-// Map syntax highlight value (`hl`) to corresponding ANSI color code
-int editorSyntaxToColor(int hl)
+// Append a span of `n` characters of class `cls` at `out`; returns the end
+unsigned char *editorPutSpan(unsigned char *out, int cls, unsigned n)
 {
-	switch (hl) {
-		case HL_COMMENT:
-		case HL_MLCOMMENT: return 36;
-		case HL_KEYWORD1: return 33;
-		case HL_KEYWORD2: return 32;
-		case HL_STRING: return 35;
-		case HL_NUMBER: return 31;
-		case HL_MATCH: return 34;
-		default: return 37;
+	if (n == 0) return out;
+	if (n <= HL_SPAN_SHORT) {
+		*out++ = (cls << 5) | n;
+	} else {
+		*out++ = cls << 5;
+		for (; n >= 0x80; n >>= 7) *out++ = (n & 0x7f) | 0x80;
+		*out++ = n;
 	}
+	return out;
 }
 
-// Selects syntax highlighting based on the file extension or filename
-void editorSelectSyntaxHighlight()
+// Give `row` a new stamp whenever its characters or highlighting change.
+// Stamps are never reused, so a screen line that shows a row's stamp shows
+// the row as it is now
+void editorRowChanged(erow *row)
 {
-	E.syntax = NULL;
-	// Exit if no filename is present
-	if (E.filename == NULL) return;
-
-	// Get the extension from the filename using strrchr()
-	char *ext = strrchr(E.filename, '.');
+	static unsigned long stamps = 0;
+	// Rows may be highlighted by several threads at once
+	row->stamp = __atomic_add_fetch(&stamps, 1, __ATOMIC_RELAXED);
+}
 
-	// Loop through all entries in the HLDB (syntax database)
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct editorSyntax *s = &HLDB[j];
-		unsigned int i = 0;
-		// Check each filematch pattern in the current editorSyntax
-		while (s->filematch[i]) {
-			// Check if pattern is an extension
-			int is_ext = (s->filematch[i][0] == '.');
-
-			// Match file extension or substring of filename
-			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || // Extension match
-					(!is_ext && strstr(E.filename, s->filematch[i]))) { // Substring match
-				E.syntax = s;
-
-				// Rehighlight each row in the file after setting E.syntax
-				int filerow;
-				for (filerow = 0; filerow < E.numrows; filerow++) {
-					editorUpdateSyntax(&E.row[filerow]);
-				}
+// Replace the spans of `row` with the `bytes` encoded at `spans`
+void editorSetSpans(erow *row, const unsigned char *spans, int bytes)
+{
+	// Highlighting a row again often gives the same spans, keep its stamp then
+	if (row->hl != NULL && bytes == row->hl_len && !memcmp(row->hl, spans, bytes)) return;
+	editorRowChanged(row);
+	if (bytes != row->hl_len || row->hl == NULL) {
+		row->hl = (unsigned char*) realloc(row->hl, bytes ? bytes : 1);
+		if (row->hl == NULL) die("realloc");
+		row->hl_len = bytes;
+	}
+	memcpy(row->hl, spans, bytes);
+}
 
-				return;
+// Encode the per-character classes `hl[0..len)` as spans at `out`, which may
+// be `&hl[len]` since a span never takes more bytes than it covers
+// characters; returns the end of the encoding
+unsigned char *editorEncodeSpans(unsigned char *out, const unsigned char *hl, int len)
+{
+	int i = 0;
+	while (i < len) {
+		unsigned char cls = hl[i];
+		int j = i + 1;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		// Find the end of the span 8 bytes at a time: the first byte that
+		// differs from `cls` is the lowest non-zero byte of the xor
+		uint64_t pattern = cls * 0x0101010101010101ULL;
+		while (j + 8 <= len) {
+			uint64_t w;
+			memcpy(&w, &hl[j], 8);
+			w ^= pattern;
+			if (w) {
+				j += __builtin_ctzll(w) / 8;
+				break;
 			}
-			i++;
+			j += 8;
 		}
+		if (j + 8 > len)
+#endif
+			while (j < len && hl[j] == cls) j++;
+		out = editorPutSpan(out, cls, j - i);
+		i = j;
 	}
+	return out;
 }
 
+// Encode the per-character classes `hl[0..len)` as the spans of `row`;
+// `hl` must have room for another `len` bytes after it, the encoding is built
+// there first so `row->hl` is allocated at its exact size
+void editorStoreHighlight(erow *row, const unsigned char *hl, int len)
+{
+	unsigned char *start = (unsigned char*) &hl[len];
+	unsigned char *end = editorEncodeSpans(start, hl, len);
+	editorSetSpans(row, start, end - start);
+}
 
-/*** row operations ***/
+// Decode the span at byte `*pos` of the row's spans into its length and
+// class; returns 0 once all spans have been read
+int editorNextSpan(const erow *row, int *pos, int *len, int *hl)
+{
+	if (*pos >= row->hl_len) return 0;
+	unsigned char b = row->hl[(*pos)++];
+	*hl = HL_SPAN_CLASS(b);
+	*len = b & HL_SPAN_SHORT;
+	if (*len == 0) {
+		int shift = 0;
+		unsigned char v;
+		do {
+			v = row->hl[(*pos)++];
+			*len |= (v & 0x7f) << shift;
+			shift += 7;
+		} while (v & 0x80);
+	}
+	return 1;
+}
 
-int editorRowCxToRx(erow *row, int cx)
+// Expand the spans of `row` into one class per character in `hl`
+void editorLoadHighlight(const erow *row, unsigned char *hl)
 {
-	int rx = 0;
-	// Loop through characters up to cx
-	for (int j = 0; j < cx; j++) {
-		// If tab, calculate space to next tab stop
-		if (row->chars[j] == '\t')
-			rx += (CLITE_TAB_STOP - 1) - (rx % CLITE_TAB_STOP);
-		// Increment for regular character
-		rx++;
+	int pos = 0, at = 0, len, cls;
+	while (editorNextSpan(row, &pos, &len, &cls)) {
+		memset(&hl[at], cls, len);
+		at += len;
 	}
-	// Return final render position
-	return rx;
 }
 
-int editorRowRxToCx(erow *row, int rx)
+// Lexer states where lexing can resume: outside identifiers and numbers, no
+// keyword check before them looked past the previous character
+#define LEX_RESUMABLE(state) ((state) != LS_NORMAL && (state) != LS_NUMBER)
+
+// One pass of the lexer over a row, or over the rest of it from a saved state
+struct editorLexPass
 {
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t')
-			cur_rx += (CLITE_TAB_STOP - 1) - (cur_rx % CLITE_TAB_STOP);
-		cur_rx++;
-		// Return the char index once rx is reached
-		if (cur_rx > rx) return cx;
+	int pos, state; // Where the pass starts, and where it stopped
+	unsigned char *hl; // Class of every character of the row
+	// States saved along the way, at least CLITE_HL_RESUME_GAP apart
+	int record;
+	editorLexResume *saved;
+	int nsaved, saved_cap;
+	// States saved by the previous pass over the row, and how far the text
+	// after the edit has moved since: the pass stops at one of them that it
+	// meets in the same state at or after `converge_from`, since the rest of
+	// the row is then lexed exactly like before
+	const editorLexResume *old;
+	int nold, old_next, old_delta, converge_from;
+	int converged; // Index in `old` the pass stopped at, or -1
+};
+
+void editorLexSave(editorLexPass *p, int pos, int state)
+{
+	if (p->nsaved == p->saved_cap) {
+		p->saved_cap = p->saved_cap ? 2 * p->saved_cap : 16;
+		p->saved = (editorLexResume*) realloc(p->saved, sizeof(editorLexResume) * p->saved_cap);
+		if (p->saved == NULL) die("realloc");
 	}
-	// In case rx exceeds the valid range
-	return cx;
+	p->saved[p->nsaved].pos = pos;
+	p->saved[p->nsaved].state = state;
+	p->nsaved++;
 }
 
-void editorUpdateRow(erow *row)
+// Called at resumable positions from the one it returned last time on: saves
+// the state once far enough from the last one, and checks whether the pass
+// has converged; returns the next position to call it at, or -1 to stop
+int editorLexCheckpoint(editorLexPass *p, int i, int state)
 {
-	int tabs = 0;
-	int j;
-	// Count tabs and allocate memory for render adding 7 chars per tab
-	for (j = 0; j < row->size; j++)
-		if (row->chars[j] == '\t') tabs++;
-
-	free(row->render);
-	// since row->size counts 1 for each tab, we add 7 extra chars for each tab).
-	row->render = (char*) malloc(row->size + tabs * (CLITE_TAB_STOP - 1) + 1);
-
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		// Modify the loop to handle tabs: append one space for the tab, then fill
-		// with spaces until reaching the next tab stop (multiple of 8 columns).
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % CLITE_TAB_STOP != 0) row->render[idx++] = ' ';
-		} else {
-			row->render[idx++] = row->chars[j];
+	int next = INT_MAX;
+	if (p->old) {
+		// Old states before this position can no longer be met
+		while (p->old_next < p->nold && p->old[p->old_next].pos + p->old_delta < i)
+			p->old_next++;
+		if (p->old_next < p->nold) {
+			const editorLexResume *o = &p->old[p->old_next];
+			if (o->pos + p->old_delta == i) {
+				if (i >= p->converge_from && o->state == state) {
+					p->converged = p->old_next;
+					return -1;
+				}
+				o++;
+			}
+			if (o < &p->old[p->nold]) next = o->pos + p->old_delta;
 		}
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
-
-	// After updating render, call editorUpdateSyntax to apply syntax highlighting
-	editorUpdateSyntax(row);
+	if (p->record) {
+		int last = p->nsaved ? p->saved[p->nsaved - 1].pos : 0;
+		if (i - last >= CLITE_HL_RESUME_GAP) {
+			editorLexSave(p, i, state);
+			last = i;
+		}
+		if (last + CLITE_HL_RESUME_GAP < next) next = last + CLITE_HL_RESUME_GAP;
+	}
+	return next;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+// Run the lexer over `row` from `p->pos` in `p->state`, up to its end or
+// until the pass converges with the previous one
+void editorLexRun(erow *row, editorLexPass *p)
 {
-	if (at < 0 || at > E.numrows) return;
+	const editorLexTable *lx = E.syntax->lexer;
+	const editorKeywordSet *keywords = E.syntax->keywords;
 
-	// Reallocate memory for E.row to accommodate one more erow
-	E.row = (erow*) realloc(E.row, sizeof(erow) * (E.numrows + 1));
+	// Alias for easier access to single-line comment start pattern
+	const char *scs = E.syntax->singleline_comment_start;
+	const char *mcs = E.syntax->multiline_comment_start;
+	const char *mce = E.syntax->multiline_comment_end;
 
-	// Make room for the new row at the specified index using memmove()
-	memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
 
-	// Update idx of each row whenever a row is inserted into the file
-	for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+	// Lex the characters themselves; a tab is a separator just like the
+	// spaces it renders as
+	char *chars = row->chars;
+	unsigned char *hl = p->hl;
+	int size = row->size;
+
+	int i = p->pos;
+	int state = p->state;
+	// Only rows with saved states look at them, once per token at most
+	int next_check = (p->record || p->old) ? i + 1 : INT_MAX;
+
+	while (i < size) {
+		if (i >= next_check && LEX_RESUMABLE(state)) {
+			next_check = editorLexCheckpoint(p, i, state);
+			if (next_check < 0) break;
+		}
 
-	E.row[at].idx = at;
+		// Skip straight to the next possible end of a multi-line comment
+		if (state == LS_COMMENT) {
+			char *end = (char*) memchr(&chars[i], mce[0], size - i);
+			int skip = end ? end - &chars[i] : size - i;
+			memset(&hl[i], HL_MLCOMMENT, skip);
+			i += skip;
+			if (i >= size) break;
+		}
 
-	E.row[at].size = len;
-	E.row[at].chars = (char*) malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+		unsigned short t = lx->t[state][(unsigned char) chars[i]];
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hl_open_comment = 0;
-	editorUpdateRow(&E.row[at]);
+		if (t & LEX_DELIM) {
+			if (state == LS_COMMENT) {
+				// End of the multi-line comment
+				if (!strncmp(&chars[i], mce, mce_len)) {
+					memset(&hl[i], HL_MLCOMMENT, mce_len);
+					i += mce_len;
+					state = LS_SEPARATOR;
+					continue;
+				}
+			} else if (scs_len && !strncmp(&chars[i], scs, scs_len)) {
+				// Single-line comment, highlight the rest of the line
+				memset(&hl[i], HL_COMMENT, size - i);
+				i = size;
+				break;
+			} else if (mcs_len && mce_len && !strncmp(&chars[i], mcs, mcs_len)) {
+				// Start of a multi-line comment
+				memset(&hl[i], HL_MLCOMMENT, mcs_len);
+				i += mcs_len;
+				state = LS_COMMENT;
+				continue;
+			}
+		}
 
-	E.numrows++;
-	E.dirty++;
+		if (t & LEX_KEYWORD) {
+			// Find the end of the identifier starting here; keywords only match a
+			// whole identifier that is followed by a separator
+			int klen = editorIdentSpan(&chars[i], size - i);
+			int kw = HL_NORMAL;
+			if (is_separator(chars[i + klen]))
+				kw = editorKeywordLookup(keywords, &chars[i], klen);
+			if (kw != HL_NORMAL) {
+				memset(&hl[i], kw, klen);
+				i += klen;
+				// Inside a keyword, not a separator anymore
+				state = LS_NORMAL;
+				continue;
+			}
+		}
+
+		if ((t & LEX_ESCAPE) && i + 1 < size) {
+			// Highlight an escaped character (e.g., \" or \') as part of the string
+			hl[i] = hl[i + 1] = HL_STRING;
+			i += 2;
+			continue;
+		}
+
+		hl[i++] = LEX_HL(t);
+		state = LEX_NEXT(t);
+	}
+
+	p->pos = i;
+	p->state = state;
 }
 
-void editorFreeRow(erow *row)
+// Record an edit of `row` for the highlighter: `delta` characters inserted
+// at `at`, or removed from there if it is negative
+void editorRowMarkEdit(erow *row, int at, int delta)
 {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+	// End of the edited text, after the edit
+	int end = delta > 0 ? at + delta : at;
+	if (row->hl_dirty_from < 0) {
+		row->hl_dirty_from = at;
+		row->hl_dirty_to = end;
+	} else {
+		// Move the end of the range edited before along with the text after it
+		int to = row->hl_dirty_to;
+		if (delta > 0 && to > at) to += delta;
+		else if (delta < 0 && to >= at - delta) to += delta;
+		else if (delta < 0 && to > at) to = at;
+		if (at < row->hl_dirty_from) row->hl_dirty_from = at;
+		row->hl_dirty_to = to > end ? to : end;
+	}
+	row->hl_dirty_delta += delta;
+	editorRowTabsEdit(row, at, delta);
 }
 
-void editorDelRow(int at)
+// Drop the saved lexer states of a row, so it is lexed from the start
+void editorRowForgetLexStates(erow *row)
 {
-	if (at < 0 || at >= E.numrows) return;
-	// Free memory associated with the row being deleted
-	editorFreeRow(&E.row[at]);
+	free(row->hl_resume);
+	row->hl_resume = NULL;
+	row->hl_nresume = 0;
+}
 
-	// Shift all rows after the deleted one up by one position
-	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+int editorRowIsLong(const erow *row)
+{
+	return row->size > E.long_row;
+}
 
-	// Update idx of each row whenever a row is removed from the file
-	for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-	// Decrease the total row count
-	E.numrows--;
+// Character of a long row its highlighted segment is centred on: the cursor
+// on the cursor row, the first column on screen on the others
+int editorLongRowAnchor(erow *row)
+{
+	if (row->idx == E.cy) return E.cx;
+	return E.coloff ? editorRowRxToCx(row, E.coloff) : 0;
+}
 
-	E.dirty++;
+// Whether the highlighted segment of a long row covers what is on screen
+int editorLongRowCovered(erow *row)
+{
+	int anchor = editorLongRowAnchor(row);
+	int lo = anchor - E.screencols;
+	int hi = anchor + E.screencols;
+	if (lo < 0) lo = 0;
+	if (hi > row->size) hi = row->size;
+	return lo >= row->hl_seg_from && hi <= row->hl_seg_to;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+// Highlight only a few segments of a long row around the columns on screen,
+// leaving the rest of it as normal text. A segment not at the start of the
+// row is lexed as if it started after a separator, and the row does not pass
+// on a multi-line comment unless it was lexed whole; returns the comment
+// state at its end
+int editorLexSegment(erow *row, int in_comment)
 {
-	// Clamp 'at' to be within [0, row->size], allowing insert at end of row
+	int from = editorLongRowAnchor(row);
+	from -= from % CLITE_LONG_ROW_SEGMENT;
+	from = from > CLITE_LONG_ROW_SEGMENT ? from - CLITE_LONG_ROW_SEGMENT : 0;
+	int to = from + 3 * CLITE_LONG_ROW_SEGMENT;
+	if (to > row->size) to = row->size;
+	row->hl_seg_from = from;
+	row->hl_seg_to = to;
+
+	// The classes of the segment are followed by its spans and the normal
+	// spans around it, each of those up to 6 bytes
+	int len = to - from;
+	unsigned char *hl = editorHighlightScratch(2 * len + 16);
+
+	// Lex the segment as a row of its own
+	erow seg = {};
+	seg.chars = &row->chars[from];
+	seg.size = len;
+	editorLexPass p = {};
+	p.hl = hl;
+	p.state = (from == 0 && in_comment) ? LS_COMMENT : LS_SEPARATOR;
+	p.converged = -1;
+	editorLexRun(&seg, &p);
+
+	unsigned char *start = &hl[len];
+	unsigned char *out = editorPutSpan(start, HL_NORMAL, from);
+	out = editorEncodeSpans(out, hl, len);
+	out = editorPutSpan(out, HL_NORMAL, row->size - to);
+	editorSetSpans(row, start, out - start);
+
+	return from == 0 && to == row->size && p.state == LS_COMMENT;
+}
+
+// Lex a single row into its highlight spans, starting inside a multi-line
+// comment if `in_comment` is set; returns the comment state at its end.
+// Rows too long for the highlight cache keep lexer states along the way, and
+// after an edit are lexed from the last state before it only until the
+// states match the previous pass again
+int editorLexRow(erow *row, int in_comment)
+{
+	int size = row->size;
+	int old_size = size - row->hl_dirty_delta;
+	int dirty_from = row->hl_dirty_from < 0 ? size : row->hl_dirty_from;
+	int dirty_to = row->hl_dirty_from < 0 ? size : row->hl_dirty_to;
+	row->hl_dirty_from = -1;
+	row->hl_dirty_delta = 0;
+
+	if (E.syntax && editorRowIsLong(row)) {
+		editorRowForgetLexStates(row);
+		return editorLexSegment(row, in_comment);
+	}
+
+	// The row is lexed one class per character, then stored as spans; the
+	// scratch buffer also holds the previous classes or the encoding after it
+	unsigned char *hl = editorHighlightScratch(size + (old_size > size ? old_size : size));
+
+	if (E.syntax == NULL) {
+		editorRowForgetLexStates(row);
+		// Set all `hl` values to HL_NORMAL (default)
+		memset(hl, HL_NORMAL, size);
+		editorStoreHighlight(row, hl, size);
+		return 0;
+	}
+
+	editorLexPass p = {};
+	p.hl = hl;
+	p.state = in_comment ? LS_COMMENT : LS_SEPARATOR;
+	p.record = size > CLITE_HL_CACHE_MAX_ROW;
+	p.converged = -1;
+	unsigned char *old_hl = &hl[size];
+
+	if (p.record && row->hl_nresume && row->hl_resume[0].state == p.state) {
+		// A delimiter check can look this far ahead, so states closer than
+		// that to the edit may have depended on the edited text
+		const char *delims[] = { E.syntax->singleline_comment_start,
+			E.syntax->multiline_comment_start, E.syntax->multiline_comment_end };
+		int ahead = 1;
+		for (int j = 0; j < 3; j++)
+			if (delims[j] && (int) strlen(delims[j]) > ahead) ahead = strlen(delims[j]);
+
+		int k = row->hl_nresume - 1;
+		while (k > 0 && row->hl_resume[k].pos + ahead > dirty_from) k--;
+
+		// Everything before the state resumed from keeps its classes
+		editorLoadHighlight(row, old_hl);
+		memcpy(hl, old_hl, row->hl_resume[k].pos);
+		for (int j = 0; j <= k; j++)
+			editorLexSave(&p, row->hl_resume[j].pos, row->hl_resume[j].state);
+
+		p.pos = row->hl_resume[k].pos;
+		p.state = row->hl_resume[k].state;
+		p.old = row->hl_resume;
+		p.nold = row->hl_nresume;
+		p.old_next = k + 1;
+		p.old_delta = size - old_size;
+		p.converge_from = dirty_to;
+	} else if (p.record) {
+		editorLexSave(&p, 0, p.state);
+	}
+
+	editorLexRun(row, &p);
+
+	int out = (p.state == LS_COMMENT);
+	if (p.converged >= 0) {
+		// The rest of the row is highlighted just like before, shifted along
+		int from = p.old[p.converged].pos;
+		memcpy(&hl[from + p.old_delta], &old_hl[from], old_size - from);
+		for (int j = p.converged; j < p.nold; j++)
+			editorLexSave(&p, p.old[j].pos + p.old_delta, p.old[j].state);
+		out = row->hl_open_comment;
+	}
+
+	editorRowForgetLexStates(row);
+	row->hl_resume = p.saved;
+	row->hl_nresume = p.nsaved;
+
+	editorStoreHighlight(row, hl, size);
+
+	return out;
+}
+
+// Recently lexed rows, keyed by their characters, starting comment state and
+// syntax; duplicated lines and text seen before skip the lexer
+struct editorHlCacheEntry
+{
+	uint64_t hash; // editorHashRow() of the characters
+	int size;
+	const editorSyntax *syntax;
+	unsigned char in_comment, out_comment;
+	char *chars; // The row's characters, compared on a hit, followed by the spans
+	unsigned char *spans;
+	int spans_len;
+	int newer, older; // Least recently used list, -1 terminated
+	int next; // Next entry in the same bucket
+};
+
+struct editorHlCache
+{
+	editorHlCacheEntry *entries; // Allocated on first use
+	int *buckets; // CLITE_HL_CACHE_ENTRIES chains of entries
+	int used;
+	int newest, oldest;
+	int bypass; // Set while rows are highlighted on several threads
+};
+
+struct editorHlCache HLC;
+
+// Hash of a row's characters, taking 8 bytes at a time
+uint64_t editorHashRow(const char *s, int len)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t) len;
+	int i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, &s[i], 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	for (; i < len; i++) h = (h ^ (unsigned char) s[i]) * 0x100000001b3ULL;
+	return h ^ (h >> 29);
+}
+
+int editorHlCacheBucket(uint64_t hash, int in_comment)
+{
+	return (hash ^ (in_comment ? 0x5bd1e995 : 0)) & (CLITE_HL_CACHE_ENTRIES - 1);
+}
+
+// Move entry `k` to the front of the least recently used list
+void editorHlCacheTouch(int k)
+{
+	editorHlCacheEntry *e = &HLC.entries[k];
+	if (HLC.newest == k) return;
+	// Unlink, if it is in the list at all
+	if (e->newer != -1) HLC.entries[e->newer].older = e->older;
+	if (e->older != -1) HLC.entries[e->older].newer = e->newer;
+	if (HLC.oldest == k) HLC.oldest = e->newer;
+
+	e->newer = -1;
+	e->older = HLC.newest;
+	if (HLC.newest != -1) HLC.entries[HLC.newest].newer = k;
+	HLC.newest = k;
+	if (HLC.oldest == -1) HLC.oldest = k;
+}
+
+// Copy the cached spans for `row` into it; returns the cached trailing comment
+// state, or -1 if the row was not found
+int editorHlCacheGet(erow *row, uint64_t hash, int in_comment)
+{
+	if (HLC.entries == NULL) return -1;
+	for (int k = HLC.buckets[editorHlCacheBucket(hash, in_comment)]; k != -1;
+			k = HLC.entries[k].next) {
+		editorHlCacheEntry *e = &HLC.entries[k];
+		if (e->hash != hash || e->size != row->size || e->syntax != E.syntax ||
+				e->in_comment != in_comment)
+			continue;
+		// Rule out a row that only has the same hash
+		if (memcmp(e->chars, row->chars, row->size)) continue;
+
+		editorSetSpans(row, e->spans, e->spans_len);
+		editorHlCacheTouch(k);
+		return e->out_comment;
+	}
+	return -1;
+}
+
+// Remember the spans just lexed for `row`, evicting the least recently used
+// entry once the cache is full
+void editorHlCachePut(erow *row, uint64_t hash, int in_comment, int out_comment)
+{
+	if (HLC.entries == NULL) {
+		HLC.entries = (editorHlCacheEntry*) malloc(sizeof(editorHlCacheEntry) * CLITE_HL_CACHE_ENTRIES);
+		HLC.buckets = (int*) malloc(sizeof(int) * CLITE_HL_CACHE_ENTRIES);
+		if (HLC.entries == NULL || HLC.buckets == NULL) die("malloc");
+		for (int j = 0; j < CLITE_HL_CACHE_ENTRIES; j++) HLC.buckets[j] = -1;
+		HLC.used = 0;
+		HLC.newest = HLC.oldest = -1;
+	}
+
+	int k;
+	editorHlCacheEntry *e;
+	if (HLC.used < CLITE_HL_CACHE_ENTRIES) {
+		k = HLC.used++;
+		e = &HLC.entries[k];
+		e->newer = e->older = -1;
+	} else {
+		// Reuse the oldest entry, taking it out of its bucket first
+		k = HLC.oldest;
+		e = &HLC.entries[k];
+		int *link = &HLC.buckets[editorHlCacheBucket(e->hash, e->in_comment)];
+		while (*link != k) link = &HLC.entries[*link].next;
+		*link = e->next;
+		free(e->chars);
+	}
+
+	e->hash = hash;
+	e->size = row->size;
+	e->syntax = E.syntax;
+	e->in_comment = in_comment;
+	e->out_comment = out_comment;
+	e->chars = (char*) malloc(row->size + row->hl_len + 1);
+	if (e->chars == NULL) die("malloc");
+	memcpy(e->chars, row->chars, row->size);
+	e->spans = (unsigned char*) &e->chars[row->size];
+	memcpy(e->spans, row->hl, row->hl_len);
+	e->spans_len = row->hl_len;
+
+	int b = editorHlCacheBucket(hash, in_comment);
+	e->next = HLC.buckets[b];
+	HLC.buckets[b] = k;
+	editorHlCacheTouch(k);
+}
+
+// Highlight a single row, starting inside a multi-line comment if
+// `in_comment` is set; returns 1 if its trailing comment state changed
+int editorHighlightRowFrom(erow *row, int in_comment)
+{
+	int out;
+	// The cache is not shared between threads, see editorHighlightParallel()
+	if (!HLC.bypass && E.syntax && row->size <= CLITE_HL_CACHE_MAX_ROW && !editorRowIsLong(row)) {
+		uint64_t hash = editorHashRow(row->chars, row->size);
+		out = editorHlCacheGet(row, hash, in_comment);
+		if (out != -1) {
+			ST.hl_cache_hits++;
+			// The spans did not come from lexing this row's current text
+			editorRowForgetLexStates(row);
+			row->hl_dirty_from = -1;
+			row->hl_dirty_delta = 0;
+		} else {
+			ST.hl_cache_misses++;
+			out = editorLexRow(row, in_comment);
+			editorHlCachePut(row, hash, in_comment, out);
+		}
+	} else {
+		out = editorLexRow(row, in_comment);
+	}
+
+	editorBracketUpdateRow(row);
+
+	// Track if the multi-line comment state has changed
+	int changed = (row->hl_open_comment != out);
+	// Set the current row's multi-line comment state = in_comment's last state
+	row->hl_open_comment = out;
+	return changed;
+}
+
+// Highlight a single row, continuing the previous row's comment state; returns
+// 1 if its trailing comment state changed
+int editorHighlightRow(erow *row)
+{
+	return editorHighlightRowFrom(row, row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+}
+
+// A chunk of rows highlighted by one worker in editorHighlightParallel()
+struct editorHlChunk
+{
+	int start, end; // Rows [start, end)
+	int entry; // Comment state assumed at the start of the chunk
+	int exit; // Comment state at the end of the chunk, given `entry`
+};
+
+struct editorHlJob
+{
+	editorHlChunk *chunks;
+	int nchunks;
+	int next; // Next chunk to take, shared by the workers
+};
+
+void *editorHighlightWorker(void *arg)
+{
+	editorHlJob *job = (editorHlJob*) arg;
+	int k;
+	while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+		editorHlChunk *c = &job->chunks[k];
+		int in_comment = c->entry;
+		for (int at = c->start; at < c->end; at++) {
+			editorHighlightRowFrom(&E.row[at], in_comment);
+			in_comment = E.row[at].hl_open_comment;
+		}
+		c->exit = in_comment;
+	}
+	editorFreeHighlightScratch();
+	return NULL;
+}
+
+// Highlight rows `from` to `to` on several threads. Every chunk but the first
+// speculatively starts outside a comment; a sequential pass afterwards redoes
+// the chunks that guessed wrong, only until a row ends in the same state as
+// it did speculatively, since the rest of the chunk is right from there on
+void editorHighlightParallel(int from, int to)
+{
+	int count = to - from + 1;
+	// A few chunks per thread, so uneven chunks still balance out
+	int chunk_rows = count / (E.hl_threads * 4);
+	if (chunk_rows < CLITE_HL_CHUNK_ROWS) chunk_rows = CLITE_HL_CHUNK_ROWS;
+
+	editorHlJob job;
+	job.nchunks = (count + chunk_rows - 1) / chunk_rows;
+	job.chunks = (editorHlChunk*) malloc(sizeof(editorHlChunk) * job.nchunks);
+	if (job.chunks == NULL) die("malloc");
+	job.next = 0;
+	for (int k = 0; k < job.nchunks; k++) {
+		job.chunks[k].start = from + k * chunk_rows;
+		job.chunks[k].end = (k == job.nchunks - 1) ? to + 1 : from + (k + 1) * chunk_rows;
+		job.chunks[k].entry = 0;
+	}
+	// The first chunk knows its real starting state
+	job.chunks[0].entry = (from > 0 && E.row[from - 1].hl_open_comment);
+
+	// The calling thread works along with the others; none of them use the
+	// highlight cache, which has no locking, or update the bracket tree
+	HLC.bypass = 1;
+	pthread_t threads[CLITE_HL_MAX_THREADS];
+	int nthreads = 0;
+	while (nthreads < E.hl_threads - 1 && nthreads < job.nchunks - 1) {
+		if (pthread_create(&threads[nthreads], NULL, editorHighlightWorker, &job) != 0) break;
+		nthreads++;
+	}
+	editorHighlightWorker(&job);
+	for (int j = 0; j < nthreads; j++) pthread_join(threads[j], NULL);
+	HLC.bypass = 0;
+
+	// Fix up the chunks whose assumed starting state was wrong
+	int in_comment = job.chunks[0].exit;
+	for (int k = 1; k < job.nchunks; k++) {
+		editorHlChunk *c = &job.chunks[k];
+		if (in_comment == c->entry) {
+			in_comment = c->exit;
+			continue;
+		}
+		int at;
+		for (at = c->start; at < c->end; at++) {
+			int changed = editorHighlightRowFrom(&E.row[at], in_comment);
+			in_comment = E.row[at].hl_open_comment;
+			if (!changed) break;
+		}
+		if (at < c->end) in_comment = c->exit;
+	}
+
+	// Put the rows' new nesting in the bracket tree in one go
+	if (BT.valid) editorBracketTreeSplice(from, count, count);
+	free(job.chunks);
+}
+
+// Mark rows from `from` onwards as needing re-highlighting; `to` is the last
+// row whose incoming comment state may be out of date
+void editorSyntaxInvalidate(int from, int to)
+{
+	if (from < E.hl_valid) {
+		// A row left pending by a partial catch-up must stay in the stale
+		// range, or catching up could stop before it on an unchanged row
+		if (E.hl_valid < E.numrows && E.hl_valid > E.hl_stale_end) E.hl_stale_end = E.hl_valid;
+		E.hl_valid = from;
+	}
+	if (to > E.hl_stale_end) E.hl_stale_end = to;
+}
+
+// Re-highlight rows from the watermark (E.hl_valid) up to and including `upto`
+void editorSyntaxCatchUp(int upto)
+{
+	if (upto >= E.numrows) upto = E.numrows - 1;
+
+	// Rows before the end of the stale range all have to be redone, so a large
+	// run of them can be split across threads
+	int bulk_end = (upto < E.hl_stale_end - 1) ? upto : E.hl_stale_end - 1;
+	if (E.hl_threads > 1 && bulk_end - E.hl_valid + 1 >= 2 * CLITE_HL_CHUNK_ROWS) {
+		editorHighlightParallel(E.hl_valid, bulk_end);
+		E.hl_valid = bulk_end + 1;
+	}
+
+	while (E.hl_valid <= upto) {
+		int at = E.hl_valid++;
+		int changed = editorHighlightRow(&E.row[at]);
+		// Past the last stale row, an unchanged trailing state means all rows
+		// below were highlighted against the same state and are still correct
+		if (!changed && at >= E.hl_stale_end) E.hl_valid = E.numrows;
+	}
+	// Everything is up to date, reset the stale range
+	if (E.hl_valid >= E.numrows) {
+		E.hl_valid = E.numrows;
+		E.hl_stale_end = 0;
+	}
+}
+
+// Move the highlighted segments of long rows on screen along with the cursor
+// and the horizontal scroll position
+void editorSyntaxFollowColumns()
+{
+	if (E.syntax == NULL) return;
+	for (int at = E.rowoff; at < E.numrows && at < E.rowoff + E.screenrows; at++) {
+		erow *row = &E.row[at];
+		if (editorRowIsLong(row) && !editorLongRowCovered(row))
+			editorLexSegment(row, at > 0 && E.row[at - 1].hl_open_comment);
+	}
+}
+
+// Highlight a slice of stale rows while the editor is idle, so rows off screen
+// are ready by the time they are scrolled to; returns 1 if any work was done
+int editorSyntaxIdle()
+{
+	if (E.hl_valid >= E.numrows) return 0;
+	editorSyntaxCatchUp(E.hl_valid + CLITE_HL_IDLE_ROWS * E.hl_threads - 1);
+	return 1;
+}
+
+void editorUpdateSyntax(erow *row)
+{
+	// Rows past the watermark are highlighted on demand, the row after this
+	// one may now see a different comment state
+	if (row->idx >= E.hl_valid) {
+		editorSyntaxInvalidate(row->idx, row->idx + 1);
+		return;
+	}
+
+	int changed = editorHighlightRow(row);
+
+	// Propagate a changed comment state iteratively instead of recursing, and
+	// stop as soon as a row ends in the same state it had before
+	int at = row->idx + 1;
+	while (changed && at < E.numrows) {
+		// Only rows on screen are re-highlighted eagerly; the rest are left
+		// stale and picked up by editorSyntaxCatchUp() when they are needed
+		if (at >= E.hl_valid || at >= E.rowoff + E.screenrows) {
+			editorSyntaxInvalidate(at, at);
+			return;
+		}
+		changed = editorHighlightRow(&E.row[at]);
+		at++;
+	}
+}
+
+// Map syntax highlight value (`hl`) to corresponding ANSI color code
+int editorSyntaxToColor(int hl)
+{
+	switch (hl) {
+		case HL_COMMENT:
+		case HL_MLCOMMENT: return 36;
+		case HL_KEYWORD1: return 33;
+		case HL_KEYWORD2: return 32;
+		case HL_STRING: return 35;
+		case HL_NUMBER: return 31;
+		case HL_MATCH: return 34;
+		default: return 37;
+	}
+}
+
+// Add a syntax to the file type lookup; a later syntax claiming the same
+// extension replaces the earlier one, so syntax files can override HLDB
+void editorRegisterSyntax(struct editorSyntax *s)
+{
+	for (unsigned int i = 0; s->filematch[i]; i++) {
+		const char *pattern = s->filematch[i];
+
+		if (pattern[0] != '.') {
+			FT.other = (editorFileType*) realloc(FT.other,
+					sizeof(editorFileType) * (FT.other_count + 1));
+			FT.other[FT.other_count].pattern = pattern;
+			FT.other[FT.other_count].syntax = s;
+			FT.other_count++;
+			continue;
+		}
+
+		// Keep the extension table at most half full, rehashing when it grows
+		if ((FT.ext_count + 1) * 2 > FT.ext_slots) {
+			editorFileType *old = FT.ext;
+			int old_slots = FT.ext_slots;
+			FT.ext_slots = old_slots ? old_slots * 2 : 64;
+			FT.ext = (editorFileType*) calloc(FT.ext_slots, sizeof(editorFileType));
+			if (FT.ext == NULL) die("calloc");
+			FT.ext_count = 0;
+			for (int j = 0; j < old_slots; j++) {
+				if (old[j].pattern == NULL) continue;
+				unsigned int h = editorHashKeyword(old[j].pattern, strlen(old[j].pattern));
+				h &= FT.ext_slots - 1;
+				while (FT.ext[h].pattern) h = (h + 1) & (FT.ext_slots - 1);
+				FT.ext[h] = old[j];
+				FT.ext_count++;
+			}
+			free(old);
+		}
+
+		unsigned int h = editorHashKeyword(pattern, strlen(pattern)) & (FT.ext_slots - 1);
+		while (FT.ext[h].pattern && strcmp(FT.ext[h].pattern, pattern))
+			h = (h + 1) & (FT.ext_slots - 1);
+		if (FT.ext[h].pattern == NULL) FT.ext_count++;
+		FT.ext[h].pattern = pattern;
+		FT.ext[h].syntax = s;
+	}
+}
+
+// Find the syntax for a filename: by extension through the hash table first,
+// then by the patterns that match anywhere in the name
+struct editorSyntax *editorFindSyntax(const char *filename)
+{
+	// Get the extension from the filename using strrchr()
+	const char *ext = strrchr(filename, '.');
+
+	if (ext && FT.ext_slots) {
+		unsigned int h = editorHashKeyword(ext, strlen(ext)) & (FT.ext_slots - 1);
+		while (FT.ext[h].pattern) {
+			if (!strcmp(FT.ext[h].pattern, ext)) return FT.ext[h].syntax;
+			h = (h + 1) & (FT.ext_slots - 1);
+		}
+	}
+
+	for (int j = 0; j < FT.other_count; j++)
+		if (strstr(filename, FT.other[j].pattern)) return FT.other[j].syntax;
+
+	return NULL;
+}
+
+// Selects syntax highlighting based on the file extension or filename
+void editorSelectSyntaxHighlight()
+{
+	E.syntax = NULL;
+	// Exit if no filename is present
+	if (E.filename == NULL) return;
+
+	E.syntax = editorFindSyntax(E.filename);
+	if (E.syntax == NULL) return;
+
+	// States saved by the lexer of another syntax are of no use
+	for (int j = 0; j < E.numrows; j++) editorRowForgetLexStates(&E.row[j]);
+
+	// Mark every row for rehighlighting after setting E.syntax; visible rows are
+	// done before the next draw, the rest while idle
+	editorSyntaxInvalidate(0, E.numrows);
+}
+
+
+/*** row operations ***/
+
+// Number of tabs in `row` before character `cx`
+int editorRowTabsBefore(erow *row, int cx)
+{
+	int lo = 0, hi = row->ntabs;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->tabs[mid].cx < cx) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Work out the render columns of the tabs from the `from`th on. A tab only
+// moves if the one before it did, so this stops at the first one that stays
+void editorRowTabsColumns(erow *row, int from)
+{
+	for (int i = from; i < row->ntabs; i++) {
+		// Characters since the previous tab take a column each
+		int rx = i ? row->tabs[i - 1].rx + row->tabs[i].cx - row->tabs[i - 1].cx - 1
+			: row->tabs[i].cx;
+		rx += CLITE_TAB_STOP - rx % CLITE_TAB_STOP;
+		if (row->tabs[i].rx == rx) break;
+		row->tabs[i].rx = rx;
+	}
+}
+
+// Keep the tab index of `row` in step with `delta` characters inserted at
+// `at`, already in `chars`, or -`delta` characters removed from there
+void editorRowTabsEdit(erow *row, int at, int delta)
+{
+	// Deleting from a row without tabs leaves nothing to update
+	if (delta < 0 && row->ntabs == 0) return;
+	int i = editorRowTabsBefore(row, at);
+	if (delta < 0) {
+		// Drop the tabs removed and move the ones after them back
+		int j = editorRowTabsBefore(row, at - delta);
+		memmove(&row->tabs[i], &row->tabs[j], sizeof(editorTab) * (row->ntabs - j));
+		row->ntabs -= j - i;
+		for (int k = i; k < row->ntabs; k++) row->tabs[k].cx += delta;
+	} else {
+		const char *text = &row->chars[at], *end = &row->chars[at + delta];
+		int added = 0;
+		for (const char *c = text; (c = (const char*) memchr(c, '\t', end - c)); c++) added++;
+		if (added) {
+			row->tabs = (editorTab*) realloc(row->tabs, sizeof(editorTab) * (row->ntabs + added));
+			if (row->tabs == NULL) die("realloc");
+			memmove(&row->tabs[i + added], &row->tabs[i], sizeof(editorTab) * (row->ntabs - i));
+			row->ntabs += added;
+		}
+		for (int k = i + added; k < row->ntabs; k++) row->tabs[k].cx += delta;
+		// The new tabs get their columns below
+		int k = i;
+		for (const char *c = text; (c = (const char*) memchr(c, '\t', end - c)); c++)
+			row->tabs[k++] = { (int) (c - row->chars), -1 };
+	}
+	editorRowTabsColumns(row, i);
+}
+
+int editorRowCxToRx(erow *row, int cx)
+{
+	// Characters after the last tab before cx take a column each
+	int i = editorRowTabsBefore(row, cx);
+	if (i == 0) return cx;
+	return row->tabs[i - 1].rx + cx - row->tabs[i - 1].cx - 1;
+}
+
+int editorRowRxToCx(erow *row, int rx)
+{
+	if (rx < 0) return 0;
+	// Find the first tab ending past rx
+	int lo = 0, hi = row->ntabs;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (row->tabs[mid].rx <= rx) lo = mid + 1;
+		else hi = mid;
+	}
+	// Characters since the tab before it take a column each, and rx is on
+	// that tab if it is past them
+	int cx = lo ? row->tabs[lo - 1].cx + 1 + rx - row->tabs[lo - 1].rx : rx;
+	if (lo < row->ntabs && cx > row->tabs[lo].cx) cx = row->tabs[lo].cx;
+	// In case rx exceeds the valid range
+	return cx < row->size ? cx : row->size;
+}
+
+// Bring what is kept about a row up to date after its characters changed;
+// tabs are expanded only for the columns drawn, see editorDrawRow()
+void editorUpdateRow(erow *row)
+{
+	editorRowChanged(row);
+	editorUpdateSyntax(row);
+}
+
+// Insert `n` rows at `at`, row `j` holding the `lens[j]` characters at
+// `lines[j]`; the row array is only moved once however many rows are added
+void editorInsertRows(int at, char **lines, size_t *lens, int n)
+{
+	if (at < 0 || at > E.numrows || n <= 0) return;
+
+	// Reallocate memory for E.row to accommodate the new rows
+	E.row = (erow*) realloc(E.row, sizeof(erow) * (E.numrows + n));
+	if (E.row == NULL) die("realloc");
+
+	// Make room for the new rows at the specified index using memmove()
+	memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numrows - at));
+
+	// Update idx of each row whenever rows are inserted into the file
+	for (int j = at + n; j < E.numrows + n; j++) E.row[j].idx += n;
+
+	// Shift the stale highlight range along with the rows
+	if (E.hl_valid > at) E.hl_valid += n;
+	if (E.hl_stale_end > at) E.hl_stale_end += n;
+
+	for (int k = 0; k < n; k++) {
+		erow *row = &E.row[at + k];
+		row->idx = at + k;
+
+		row->size = lens[k];
+		row->chars = (char*) malloc(lens[k] + 1);
+		memcpy(row->chars, lines[k], lens[k]);
+		row->chars[lens[k]] = '\0';
+		row->tabs = NULL;
+		row->ntabs = 0;
+		editorRowTabsEdit(row, 0, lens[k]);
+
+		row->hl = NULL;
+		row->hl_len = 0;
+		row->hl_resume = NULL;
+		row->hl_nresume = 0;
+		row->hl_dirty_from = -1;
+		row->hl_dirty_delta = 0;
+		row->hl_seg_from = row->hl_seg_to = 0;
+		memset(row->brackets, 0, sizeof(row->brackets));
+		// Start from the state the following row was highlighted against, so the
+		// change is only propagated when the new rows really alter it
+		row->hl_open_comment = (at > 0) ? E.row[at - 1].hl_open_comment : 0;
+	}
+	E.numrows += n;
+	if (BT.valid) editorBracketTreeSplice(at, 0, n);
+
+	// A block of new rows is highlighted together when it is needed, rather
+	// than row by row as each one is added
+	if (n > 1) editorSyntaxInvalidate(at, at + n);
+	for (int k = 0; k < n; k++) editorUpdateRow(&E.row[at + k]);
+
+	E.dirty++;
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+	editorInsertRows(at, &s, &len, 1);
+}
+
+void editorFreeRow(erow *row)
+{
+	free(row->chars);
+	free(row->hl);
+	free(row->hl_resume);
+	free(row->tabs);
+}
+
+void editorDelRow(int at)
+{
+	if (at < 0 || at >= E.numrows) return;
+	// Remember the comment state the following row was highlighted against
+	int open_comment = E.row[at].hl_open_comment;
+	// Free memory associated with the row being deleted
+	editorFreeRow(&E.row[at]);
+
+	// Shift all rows after the deleted one up by one position
+	memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+
+	// Update idx of each row whenever a row is removed from the file
+	for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
+	// Decrease the total row count
+	E.numrows--;
+
+	// Shift the stale highlight range along with the rows
+	if (E.hl_valid > at) E.hl_valid--;
+	if (E.hl_stale_end > at) E.hl_stale_end--;
+	if (BT.valid) editorBracketTreeSplice(at, 1, 0);
+	// The row that moved up now follows a different row; re-highlight it if
+	// the comment state it sees has changed
+	int prev_comment = (at > 0) ? E.row[at - 1].hl_open_comment : 0;
+	if (at < E.numrows && open_comment != prev_comment)
+		editorSyntaxInvalidate(at, at);
+
+	E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c)
+{
+	// Clamp 'at' to be within [0, row->size], allowing insert at end of row
 	if (at < 0 || at > row->size) at = row->size;
-	// Resize row, shift chars to make room, insert new char, and update render
+	// Resize row, shift chars to make room, insert new char, and update the row
 	row->chars = (char*) realloc(row->chars, row->size + 2);
 	// Like memcpy but allows overlap of source & destination
 	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
 	row->size++;
 	row->chars[at] = c;
+	editorRowMarkEdit(row, at, 1);
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+// Insert the `len` characters at `s` into `row` at `at`
+void editorRowInsertString(erow *row, int at, const char *s, size_t len)
+{
+	if (at < 0 || at > row->size) at = row->size;
+	row->chars = (char*) realloc(row->chars, row->size + len + 1);
+	if (row->chars == NULL) die("realloc");
+	memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+	memcpy(&row->chars[at], s, len);
+	row->size += len;
+	editorRowMarkEdit(row, at, len);
 	editorUpdateRow(row);
 	E.dirty++;
 }
@@ -740,6 +2027,7 @@ void editorRowAppendString(erow *row, char *s, size_t len)
 	memcpy(&row->chars[row->size], s, len);
 
 	// Update the row size and add a null terminator at the end
+	editorRowMarkEdit(row, row->size, len);
 	row->size += len;
 	row->chars[row->size] = '\0';
 
@@ -758,6 +2046,7 @@ void editorRowDelChar(erow *row, int at)
 
 	// Decrease row size and update
 	row->size--;
+	editorRowMarkEdit(row, at, -1);
 	editorUpdateRow(row);
 
 	E.dirty++;
@@ -795,6 +2084,7 @@ void editorInsertNewline()
 		row = &E.row[E.cy];
 
 		// Truncate the current row to the cursor position
+		editorRowMarkEdit(row, E.cx, E.cx - row->size);
 		row->size = E.cx;
 		row->chars[row->size] = '\0';
 
@@ -806,28 +2096,135 @@ void editorInsertNewline()
 	E.cx = 0;
 }
 
-void editorDelChar()
+// Insert `len` characters of text at the cursor, as one edit: the cursor's
+// row is split once and all the lines in between are added together.
+// "\r\n", "\r" and "\n" all end a line
+void editorInsertText(char *s, int len)
 {
-	// If the cursor is past the end of the file, do nothing
-	if (E.cy == E.numrows) return;
-	// If cursor is at the start of the first row, there's nothing to delete
-	if (E.cx == 0 && E.cy == 0) return;
+	// Past the last row, a line break adds an empty row and stays past it, as
+	// editorInsertNewline() does
+	while (len > 0 && E.cy == E.numrows && (s[0] == '\r' || s[0] == '\n')) {
+		int skip = (len > 1 && s[0] == '\r' && s[1] == '\n') ? 2 : 1;
+		editorInsertNewline();
+		s += skip;
+		len -= skip;
+	}
+	if (len == 0) return;
+	if (E.cy == E.numrows) editorInsertRow(E.numrows, (char*) "", 0);
+
+	// Find where the lines of the text start and how long they are
+	int n = 0;
+	for (int j = 0; j < len; j++) {
+		if (s[j] == '\r' && j + 1 < len && s[j + 1] == '\n') j++;
+		if (s[j] == '\r' || s[j] == '\n') n++;
+	}
+	char **lines = (char**) malloc(sizeof(char*) * (n + 1));
+	size_t *lens = (size_t*) malloc(sizeof(size_t) * (n + 1));
+	if (lines == NULL || lens == NULL) die("malloc");
+	int line = 0;
+	lines[0] = s;
+	for (int j = 0; j < len; j++) {
+		if (s[j] != '\r' && s[j] != '\n') continue;
+		lens[line] = &s[j] - lines[line];
+		if (s[j] == '\r' && j + 1 < len && s[j + 1] == '\n') j++;
+		lines[++line] = &s[j + 1];
+	}
+	lens[n] = &s[len] - lines[n];
 
-	// Get the row the cursor is currently on
 	erow *row = &E.row[E.cy];
-
-	// If there is a character to the left of the cursor, delete it
-	if (E.cx > 0) {
-		editorRowDelChar(row, E.cx - 1);
-		// Move the cursor one step left
-		E.cx--;
+	if (n == 0) {
+		editorRowInsertString(row, E.cx, s, len);
+		E.cx += len;
 	} else {
-		// Set cursor to the end of the previous row
-		E.cx = E.row[E.cy - 1].size;
-		// Append current row to previous one
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		// Delete the current row
-		editorDelRow(E.cy);
+		// The last line continues with the rest of the cursor's row
+		size_t tail = row->size - E.cx;
+		char *last = (char*) malloc(lens[n] + tail);
+		if (last == NULL) die("malloc");
+		memcpy(last, lines[n], lens[n]);
+		memcpy(&last[lens[n]], &row->chars[E.cx], tail);
+		int cx = lens[n];
+		lines[n] = last;
+		lens[n] += tail;
+		editorInsertRows(E.cy + 1, &lines[1], &lens[1], n);
+		free(last);
+
+		// Truncate the cursor's row and end it with the first line
+		row = &E.row[E.cy];
+		editorRowMarkEdit(row, E.cx, E.cx - row->size);
+		row->size = E.cx;
+		row->chars[row->size] = '\0';
+		editorRowInsertString(row, E.cx, lines[0], lens[0]);
+
+		E.cy += n;
+		E.cx = cx;
+	}
+	free(lines);
+	free(lens);
+}
+
+// Read text pasted in bracketed paste mode, up to the closing "\x1b[201~",
+// and return it with its length. If the end marker gets lost, whatever came
+// before the input went quiet is taken as the whole paste
+#define CLITE_PASTE_TIMEOUT_MS 1000
+char *editorReadPaste(int *len)
+{
+	int cap = 4096;
+	char *text = (char*) malloc(cap);
+	if (text == NULL) die("malloc");
+	*len = 0;
+	long last = editorNowMs();
+	while (1) {
+		int nread = editorReadByte(&text[*len]);
+		if (nread == -1 && errno != EAGAIN) die("read");
+		if (nread != 1) {
+			if (editorNowMs() - last >= CLITE_PASTE_TIMEOUT_MS) break;
+			continue;
+		}
+		last = editorNowMs();
+		if (++*len >= 6 && !memcmp(&text[*len - 6], "\x1b[201~", 6)) {
+			*len -= 6;
+			break;
+		}
+		if (*len == cap) {
+			cap *= 2;
+			text = (char*) realloc(text, cap);
+			if (text == NULL) die("realloc");
+		}
+	}
+	return text;
+}
+
+// Insert pasted text in one go
+void editorPaste()
+{
+	int len;
+	char *text = editorReadPaste(&len);
+	editorInsertText(text, len);
+	free(text);
+}
+
+void editorDelChar()
+{
+	// If the cursor is past the end of the file, do nothing
+	if (E.cy == E.numrows) return;
+	// If cursor is at the start of the first row, there's nothing to delete
+	if (E.cx == 0 && E.cy == 0) return;
+
+	// Get the row the cursor is currently on
+	erow *row = &E.row[E.cy];
+
+	// If there is a character to the left of the cursor, delete it
+	if (E.cx > 0) {
+		editorRowDelChar(row, E.cx - 1);
+		// Move the cursor one step left
+		E.cx--;
+	} else {
+		// Set cursor to the end of the previous row
+		E.cx = E.row[E.cy - 1].size;
+		// Append current row to previous one
+		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+		// Delete the current row
+		editorDelRow(E.cy);
 		// Move cursor up to the previous row
 		E.cy--;
 	}
@@ -926,152 +2323,1012 @@ void editorSave()
 				return;
 			}
 		}
-		close(fd);
+		close(fd);
+	}
+
+	free(buf);
+	// strerror() returns the error message corresponding to errno
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+
+/*** search ***/
+
+void editorFindCallback(char *query, int key)
+{
+	// Stores the last match index or -1 if none
+	static int last_match = -1;
+	// Search direction: 1 for forward, -1 for backward
+	static int direction = 1;
+
+	// Line number where highlights need to be restored
+	static int saved_hl_line;
+	// Holds the previous highlight spans for a row
+	static unsigned char *saved_hl = NULL;
+	static int saved_hl_len;
+
+	// Restore previous highlight state if it exists
+	if (saved_hl) {
+		// Put the saved spans back in place of the ones with the match
+		free(E.row[saved_hl_line].hl);
+		E.row[saved_hl_line].hl = saved_hl;
+		E.row[saved_hl_line].hl_len = saved_hl_len;
+		editorRowChanged(&E.row[saved_hl_line]);
+		// Reset the saved highlight pointer
+		saved_hl = NULL;
+	}
+
+	// Exit search on Enter/Escape, else repeat search for any other key.
+	if (key == '\r' || key == '\x1b') {
+		// Reset last_match and direction to initial values as we are leaving search
+		last_match = -1;
+		direction = 1;
+		return;
+	} 
+	// Set direction to forward if right/down arrow keys are pressed
+	else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		direction = 1;
+	}
+	// Set direction to backward if left/up arrow keys are pressed
+	else if (key == ARROW_LEFT || key == ARROW_UP) {
+		direction = -1;
+	}
+	// Reset search if any other key is pressed
+	else {
+		last_match = -1;
+		direction = 1;
+	}
+
+	// If there was no previous match, search starts from the first row, forward
+	if (last_match == -1) direction = 1;
+
+	// Start search from the last match position
+	int current = last_match;
+
+	int i;
+	// Loop through all rows to search for the query
+	for (i = 0; i < E.numrows; i++) {
+		current += direction;
+
+		// Wrap around to the opposite end of the file when we reach the start/end
+		if (current == -1) current = E.numrows - 1;
+		else if (current == E.numrows) current = 0;
+
+		// Make sure the row's highlighting is current before it is saved below
+		editorSyntaxCatchUp(current);
+		erow *row = &E.row[current];
+		// Check if query is found in the current row's characters using strstr()
+		char *match = strstr(row->chars, query);
+		if (match) {
+			last_match = current;
+			// Set cursor position to the match's location
+			E.cy = current;
+			// Set the column to the position of the match within the row by calculating
+			// the offset between the start of the row and the match pointer
+			E.cx = match - row->chars;
+			int match_end = E.cx + strlen(query);
+			// Set rowoff to bottom to scroll the match to the top of the screen
+			E.rowoff = E.numrows;
+
+			// A long row is only highlighted around the cursor, which just moved
+			if (E.syntax && editorRowIsLong(row) && !editorLongRowCovered(row))
+				editorLexSegment(row, current > 0 && E.row[current - 1].hl_open_comment);
+
+			// Expand the spans and mark the matched substring as HL_MATCH
+			unsigned char *hl = (unsigned char*) malloc(2 * row->size + 1);
+			editorLoadHighlight(row, hl);
+			memset(&hl[E.cx], HL_MATCH, match_end - E.cx);
+
+			// Save current highlight state before modifying it
+			saved_hl_line = current;
+			saved_hl = row->hl;
+			saved_hl_len = row->hl_len;
+			row->hl = NULL;
+			editorStoreHighlight(row, hl, row->size);
+			free(hl);
+			break;
+		}
+	}
+}
+
+void editorFind()
+{
+	int saved_cx = E.cx;
+	int saved_cy = E.cy;
+	int saved_coloff = E.coloff;
+	int saved_rowoff = E.rowoff;
+
+	// Get the search query from the user; ESC to cancel returns NULL
+	char *query = editorPrompt((char*) "Search: %s (Use ESC/Arrows/Enter)",
+					editorFindCallback);
+
+	if (query) {
+		free(query);
+	} else {
+		// If search is cancelled, restore the values we saved
+		E.cx = saved_cx;
+		E.cy = saved_cy;
+		E.coloff = saved_coloff;
+		E.rowoff = saved_rowoff;
+	}
+}
+
+
+/*** brackets ***/
+
+// Kind of bracket `c` is, or -1 if it is none; sets `*open` for an opening one
+int editorBracketKind(int c, int *open)
+{
+	switch (c) {
+		case '(': *open = 1; return 0;
+		case ')': *open = 0; return 0;
+		case '[': *open = 1; return 1;
+		case ']': *open = 0; return 1;
+		case '{': *open = 1; return 2;
+		case '}': *open = 0; return 2;
+		default: return -1;
+	}
+}
+
+// Brackets only count outside strings and comments
+int editorBracketCounts(int hl)
+{
+	return hl != HL_COMMENT && hl != HL_MLCOMMENT && hl != HL_STRING;
+}
+
+// Nesting of the text `a` followed by the text `b`
+editorBracketSum editorBracketJoin(editorBracketSum a, editorBracketSum b)
+{
+	editorBracketSum r;
+	r.sum = a.sum + b.sum;
+	r.low = a.low < a.sum + b.low ? a.low : a.sum + b.low;
+	r.back_low = b.back_low < a.back_low - b.sum ? b.back_low : a.back_low - b.sum;
+	return r;
+}
+
+// Highlight class of character `at` of a row
+int editorHighlightAt(const erow *row, int at)
+{
+	int pos = 0, start = 0, len, hl;
+	while (editorNextSpan(row, &pos, &len, &hl)) {
+		if (at < start + len) return hl;
+		start += len;
+	}
+	return HL_NORMAL;
+}
+
+// Recompute the size and nesting of subtree `t` from its children
+void editorBracketPull(int t)
+{
+	editorBracketNode *n = &BT.node[t];
+	const editorBracketNode *l = &BT.node[n->left], *r = &BT.node[n->right];
+	n->size = l->size + 1 + r->size;
+	for (int k = 0; k < BRACKET_KINDS; k++)
+		n->sub[k] = editorBracketJoin(editorBracketJoin(l->sub[k], n->row[k]), r->sub[k]);
+}
+
+// Split subtree `t` into its first `at` rows and the rest
+void editorBracketSplit(int t, int at, int *a, int *b)
+{
+	if (t == 0) {
+		*a = *b = 0;
+		return;
+	}
+	editorBracketNode *n = &BT.node[t];
+	int lsize = BT.node[n->left].size;
+	if (at <= lsize) {
+		editorBracketSplit(n->left, at, a, &n->left);
+		*b = t;
+	} else {
+		editorBracketSplit(n->right, at - lsize - 1, &n->right, b);
+		*a = t;
+	}
+	editorBracketPull(t);
+}
+
+// Join subtrees `a` and `b`, the rows of `b` coming after those of `a`
+int editorBracketMerge(int a, int b)
+{
+	if (a == 0) return b;
+	if (b == 0) return a;
+	if (BT.node[a].prio > BT.node[b].prio) {
+		BT.node[a].right = editorBracketMerge(BT.node[a].right, b);
+		editorBracketPull(a);
+		return a;
+	}
+	BT.node[b].left = editorBracketMerge(a, BT.node[b].left);
+	editorBracketPull(b);
+	return b;
+}
+
+// Return the nodes of subtree `t` to the free list
+void editorBracketFree(int t)
+{
+	if (t == 0) return;
+	editorBracketFree(BT.node[t].right);
+	int left = BT.node[t].left;
+	BT.node[t].left = BT.free;
+	BT.free = t;
+	editorBracketFree(left);
+}
+
+// Build a subtree of new nodes for rows [at, at + n) in O(n): each node is
+// added on the right edge, under the last node there of higher priority
+int editorBracketBuild(int at, int n)
+{
+	if (n == 0) return 0;
+	// Take the nodes first, growing the array moves it
+	int *ids = (int*) malloc(sizeof(int) * n);
+	if (ids == NULL) die("malloc");
+	for (int j = 0; j < n; j++) {
+		if (BT.free) {
+			ids[j] = BT.free;
+			BT.free = BT.node[BT.free].left;
+			continue;
+		}
+		if (BT.used == BT.cap) {
+			BT.cap = BT.cap ? BT.cap * 2 : 1024;
+			BT.node = (editorBracketNode*) realloc(BT.node, sizeof(editorBracketNode) * BT.cap);
+			if (BT.node == NULL) die("realloc");
+			// Node 0 is empty and has size 0, nesting {0, 0, 0}
+			if (BT.used == 0) memset(&BT.node[BT.used++], 0, sizeof(editorBracketNode));
+		}
+		ids[j] = BT.used++;
+	}
+
+	// Right edge of the tree built so far, from the root down
+	int *edge = (int*) malloc(sizeof(int) * n);
+	if (edge == NULL) die("malloc");
+	int depth = 0;
+	for (int j = 0; j < n; j++) {
+		editorBracketNode *x = &BT.node[ids[j]];
+		memcpy(x->row, E.row[at + j].brackets, sizeof(x->row));
+		x->left = x->right = 0;
+		// xorshift32
+		BT.seed ^= BT.seed << 13;
+		BT.seed ^= BT.seed >> 17;
+		BT.seed ^= BT.seed << 5;
+		x->prio = BT.seed;
+
+		// Nodes of lower priority on the edge become the new node's left subtree
+		int last = 0;
+		while (depth > 0 && BT.node[edge[depth - 1]].prio < x->prio) {
+			last = edge[--depth];
+			editorBracketPull(last);
+		}
+		x->left = last;
+		if (depth > 0) BT.node[edge[depth - 1]].right = ids[j];
+		edge[depth++] = ids[j];
+	}
+	while (depth > 1) editorBracketPull(edge[--depth]);
+	editorBracketPull(edge[0]);
+	int root = edge[0];
+	free(edge);
+	free(ids);
+	return root;
+}
+
+// Replace the `old` rows at `at` in the tree with the `n` rows now there,
+// after rows were inserted, deleted or rehighlighted in bulk
+void editorBracketTreeSplice(int at, int old, int n)
+{
+	int a, b, c;
+	editorBracketSplit(BT.root, at, &a, &b);
+	editorBracketSplit(b, old, &b, &c);
+	editorBracketFree(b);
+	BT.root = editorBracketMerge(editorBracketMerge(a, editorBracketBuild(at, n)), c);
+}
+
+// Copy the nesting of row `row`, the `at`th one of subtree `t`, into its
+// node and update the nodes above it
+void editorBracketSetNode(int t, int at, int row)
+{
+	editorBracketNode *n = &BT.node[t];
+	int lsize = BT.node[n->left].size;
+	if (at < lsize) editorBracketSetNode(n->left, at, row);
+	else if (at > lsize) editorBracketSetNode(n->right, at - lsize - 1, row);
+	else memcpy(n->row, E.row[row].brackets, sizeof(n->row));
+	editorBracketPull(t);
+}
+
+// Update the tree after row `at` was highlighted
+void editorBracketTreeSet(int at)
+{
+	editorBracketSetNode(BT.root, at, at);
+}
+
+// Put all rows in the tree, the first time brackets are matched
+void editorBracketTreeBuild()
+{
+	if (BT.seed == 0) BT.seed = 2463534242u;
+	BT.root = editorBracketBuild(0, E.numrows);
+	BT.valid = 1;
+}
+
+// Recompute the bracket nesting of a row after it was highlighted. Long rows
+// are only partly highlighted and are left out, like they are for comments
+void editorBracketUpdateRow(erow *row)
+{
+	editorBracketSum sum[BRACKET_KINDS] = {};
+	if (!editorRowIsLong(row)) {
+		int pos = 0, cx = 0, len, hl;
+		while (editorNextSpan(row, &pos, &len, &hl)) {
+			int end = cx + len;
+			if (!editorBracketCounts(hl)) {
+				cx = end;
+				continue;
+			}
+			for (; cx < end; cx++) {
+				int open;
+				int k = editorBracketKind(row->chars[cx], &open);
+				if (k == -1) continue;
+				editorBracketSum b = open ? editorBracketSum{1, 0, -1} : editorBracketSum{-1, -1, 0};
+				sum[k] = editorBracketJoin(sum[k], b);
+			}
+		}
+	}
+
+	if (!memcmp(sum, row->brackets, sizeof(sum))) return;
+	memcpy(row->brackets, sum, sizeof(sum));
+	// Rows highlighted on other threads are picked up by the next rebuild
+	if (BT.valid && !HLC.bypass) editorBracketTreeSet(row->idx);
+}
+
+// First row in [from, to) of subtree `t`, whose rows start at `lo`, where the
+// nesting of bracket kind `k`, starting at `*depth`, drops below 0; returns
+// -1 if there is none, with the rows passed added to `*depth`
+int editorBracketFindForward(int k, int t, int lo, int from, int to, int *depth)
+{
+	if (t == 0) return -1;
+	const editorBracketNode *n = &BT.node[t];
+	int hi = lo + n->size;
+	if (hi <= from || lo >= to) return -1;
+	if (lo >= from && hi <= to && *depth + n->sub[k].low >= 0) {
+		*depth += n->sub[k].sum;
+		return -1;
+	}
+	int r = editorBracketFindForward(k, n->left, lo, from, to, depth);
+	if (r != -1) return r;
+	int self = lo + BT.node[n->left].size;
+	if (self >= from && self < to) {
+		if (*depth + n->row[k].low < 0) return self;
+		*depth += n->row[k].sum;
+	}
+	return editorBracketFindForward(k, n->right, self + 1, from, to, depth);
+}
+
+// Last row up to `to` where the nesting drops below 0 reading backwards
+int editorBracketFindBackward(int k, int t, int lo, int to, int *depth)
+{
+	if (t == 0) return -1;
+	const editorBracketNode *n = &BT.node[t];
+	if (lo > to) return -1;
+	if (lo + n->size - 1 <= to && *depth + n->sub[k].back_low >= 0) {
+		*depth -= n->sub[k].sum;
+		return -1;
+	}
+	int self = lo + BT.node[n->left].size;
+	int r = editorBracketFindBackward(k, n->right, self + 1, to, depth);
+	if (r != -1) return r;
+	if (self <= to) {
+		if (*depth + n->row[k].back_low < 0) return self;
+		*depth -= n->row[k].sum;
+	}
+	return editorBracketFindBackward(k, n->left, lo, to, depth);
+}
+
+// Scan a row from character `from` in direction `dir` for the bracket of kind
+// `k` where the nesting, starting at `*depth`, drops below 0; returns its
+// position or -1, with the brackets passed added to `*depth`
+int editorBracketScanRow(erow *row, int k, int from, int dir, int *depth)
+{
+	unsigned char *hl = editorHighlightScratch(row->size + 1);
+	editorLoadHighlight(row, hl);
+	for (int j = from; j >= 0 && j < row->size; j += dir) {
+		int open = 0;
+		if (editorBracketKind(row->chars[j], &open) != k || !editorBracketCounts(hl[j])) continue;
+		*depth += open ? dir : -dir;
+		if (*depth < 0) return j;
+	}
+	return -1;
+}
+
+// Find the bracket of kind `k` that closes the nesting at row `cy`, character
+// `cx`, looking forwards or backwards from there depending on `dir`; returns
+// 1 and its position if there is one
+int editorBracketFind(int k, int cy, int cx, int dir, int *out_cy, int *out_cx)
+{
+	// The rows searched must be highlighted, which their nesting in the tree
+	// then follows
+	editorSyntaxCatchUp(cy);
+	if (!BT.valid) editorBracketTreeBuild();
+
+	int depth = 0;
+	int at = editorBracketScanRow(&E.row[cy], k, cx + dir, dir, &depth);
+	int row = cy;
+	if (at == -1) {
+		// Skip straight to the row the nesting drops below 0 in
+		if (dir > 0) {
+			// Search the rows highlighted already, and only highlight more,
+			// in growing steps, while the match isn't found
+			int from = cy + 1, step = E.screenrows > 0 ? E.screenrows : 1;
+			row = -1;
+			while (row == -1 && from < E.numrows) {
+				if (E.hl_valid <= from) {
+					editorSyntaxCatchUp(from + step - 1);
+					step *= 2;
+				}
+				int to = E.hl_valid;
+				row = editorBracketFindForward(k, BT.root, 0, from, to, &depth);
+				from = to;
+			}
+		} else {
+			row = editorBracketFindBackward(k, BT.root, 0, cy - 1, &depth);
+		}
+		if (row == -1) return 0;
+		erow *r = &E.row[row];
+		at = editorBracketScanRow(r, k, dir > 0 ? 0 : r->size - 1, dir, &depth);
+		if (at == -1) return 0;
+	}
+	*out_cy = row;
+	*out_cx = at;
+	return 1;
+}
+
+// Move the cursor to the bracket matching the one under it
+void editorMatchBracket()
+{
+	if (E.cy >= E.numrows) return;
+	erow *row = &E.row[E.cy];
+	int open;
+	int k = (E.cx < row->size) ? editorBracketKind(row->chars[E.cx], &open) : -1;
+	if (k == -1 || !editorBracketCounts(editorHighlightAt(row, E.cx))) {
+		editorSetStatusMessage("No bracket under the cursor");
+		return;
+	}
+	if (!editorBracketFind(k, E.cy, E.cx, open ? 1 : -1, &E.cy, &E.cx))
+		editorSetStatusMessage("No matching bracket");
+}
+
+// Move the cursor to the opening brace of the block it is in; repeating it
+// moves out one block at a time
+void editorEnclosingBlock()
+{
+	if (E.cy >= E.numrows) return;
+	if (!editorBracketFind(2, E.cy, E.cx, -1, &E.cy, &E.cx))
+		editorSetStatusMessage("Not inside a block");
+}
+
+
+/*** append buffer ***/
+
+// TODO: Implement the append buffer using std::string/vector if possible
+struct abuf
+{
+	char *b;
+	int len;
+	int cap; // Bytes allocated for `b`, kept when the buffer is emptied
+
+	// Use constructor supported in C++ for struct abuf instead of defined constant
+	abuf() : b(NULL), len(0), cap(0) {}
+
+	// Use destructor supported in C++ for struct abuf instead of function abFree()
+	~abuf()
+	{
+		free(b);
+	}
+};
+
+// Make room for `len` more bytes, doubling the buffer so appending costs
+// amortised constant time; returns 0 if the memory isn't available
+int abReserve(struct abuf *ab, int len)
+{
+	if (ab->len + len <= ab->cap) return 1;
+	int cap = ab->cap ? ab->cap : 256;
+	while (cap < ab->len + len) cap *= 2;
+	char *newb = (char*) realloc(ab->b, cap);
+	if (newb == NULL) return 0;
+	ab->b = newb;
+	ab->cap = cap;
+	ST.ab_allocs++;
+	return 1;
+}
+
+// TODO: Refactor later as member function of struct if possible
+inline void abAppend(struct abuf *ab, const char *s, int len)
+{
+	if (ab->len + len > ab->cap && !abReserve(ab, len)) return;
+	// Copy the string at the end of current data in buffer
+	memcpy(&ab->b[ab->len], s, len);
+	ab->len += len;
+}
+
+
+/*** syntax files ***/
+
+// Syntax definitions are read from *.syntax files in $CLITE_SYNTAX_DIR (or
+// ~/.clite/syntax), one "key value..." per line:
+//
+//   filetype  rust
+//   filematch .rs
+//   keywords  fn let mut if else match while for loop return
+//   types     i32 u32 bool str
+//   comment   //
+//   multiline /* */
+//   flags     numbers strings
+//
+// They are compiled into keyword tables and lexer tables and stored in a
+// cache file next to them, which later runs map straight into memory as long
+// as no syntax file has changed since.
+
+#define CLITE_SYNTAX_CACHE "syntax.cache"
+#define CLITE_SYNTAX_CACHE_MAGIC "CLITESC1"
+
+// Header of the syntax cache; all offsets in the cache are from the start of
+// the file, so it can be used directly from mmap()
+struct editorSyntaxCacheHeader
+{
+	char magic[8];
+	unsigned int kwset_size; // sizeof(editorKeywordSet) when written
+	unsigned int lexer_size; // sizeof(editorLexTable) when written
+	unsigned int nsources;
+	unsigned int nsyntax;
+};
+
+// A syntax file the cache was compiled from
+struct editorSyntaxCacheSource
+{
+	unsigned int name;
+	unsigned int pad;
+	long long mtime;
+	long long size;
+};
+
+// A compiled syntax; string offsets of 0 mean "not set"
+struct editorSyntaxCacheEntry
+{
+	unsigned int filetype;
+	unsigned int filematch; // Offset of an array of string offsets
+	unsigned int nfilematch;
+	unsigned int scs;
+	unsigned int mcs;
+	unsigned int mce;
+	int flags;
+	unsigned int keywords; // Offset of an editorKeywordSet
+	unsigned int lexer; // Offset of an editorLexTable
+	unsigned int pad;
+};
+
+// A syntax file found in the syntax directory
+struct editorSyntaxSource
+{
+	char *name;
+	struct stat st;
+};
+
+// A syntax definition as parsed from a file
+struct editorSyntaxDef
+{
+	char *filetype;
+	char **filematch;
+	int nfilematch;
+	char **keywords; // NULL terminated, secondary keywords end in '|'
+	int nkeywords;
+	char *scs;
+	char *mcs;
+	char *mce;
+	int flags;
+};
+
+int editorCompareSyntaxSources(const void *a, const void *b)
+{
+	return strcmp(((const editorSyntaxSource*) a)->name,
+			((const editorSyntaxSource*) b)->name);
+}
+
+// List the *.syntax files in `dir` sorted by name; returns their count
+int editorListSyntaxFiles(const char *dir, editorSyntaxSource **out)
+{
+	*out = NULL;
+	DIR *d = opendir(dir);
+	if (d == NULL) return 0;
+
+	int n = 0;
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		size_t len = strlen(ent->d_name);
+		if (len <= 7 || strcmp(&ent->d_name[len - 7], ".syntax")) continue;
+
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		struct stat st;
+		if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) continue;
+
+		*out = (editorSyntaxSource*) realloc(*out, sizeof(editorSyntaxSource) * (n + 1));
+		(*out)[n].name = strdup(ent->d_name);
+		(*out)[n].st = st;
+		n++;
+	}
+	closedir(d);
+
+	qsort(*out, n, sizeof(editorSyntaxSource), editorCompareSyntaxSources);
+	return n;
+}
+
+void editorFreeSyntaxDef(editorSyntaxDef *def)
+{
+	free(def->filetype);
+	for (int j = 0; j < def->nfilematch; j++) free(def->filematch[j]);
+	free(def->filematch);
+	for (int j = 0; j < def->nkeywords; j++) free(def->keywords[j]);
+	free(def->keywords);
+	free(def->scs);
+	free(def->mcs);
+	free(def->mce);
+}
+
+// Append a string to a NULL terminated list
+void editorDefAppend(char ***list, int *n, char *s)
+{
+	*list = (char**) realloc(*list, sizeof(char*) * (*n + 2));
+	(*list)[(*n)++] = s;
+	(*list)[*n] = NULL;
+}
+
+// Parse one syntax file into `def`; returns NULL on success or an error message
+const char *editorParseSyntaxFile(const char *path, editorSyntaxDef *def)
+{
+	memset(def, 0, sizeof(*def));
+	FILE *fp = fopen(path, "r");
+	if (!fp) return strerror(errno);
+
+	const char *sep = " \t\r\n";
+	const char *err = NULL;
+	char *line = NULL;
+	size_t linecap = 0;
+	while (err == NULL && getline(&line, &linecap, fp) != -1) {
+		char *save;
+		char *key = strtok_r(line, sep, &save);
+		// Skip blank lines and comments
+		if (key == NULL || key[0] == '#') continue;
+
+		char *val = strtok_r(NULL, sep, &save);
+		if (val == NULL) {
+			err = "missing value";
+		} else if (!strcmp(key, "filetype")) {
+			free(def->filetype);
+			def->filetype = strdup(val);
+		} else if (!strcmp(key, "filematch")) {
+			for (; val; val = strtok_r(NULL, sep, &save))
+				editorDefAppend(&def->filematch, &def->nfilematch, strdup(val));
+		} else if (!strcmp(key, "keywords") || !strcmp(key, "types")) {
+			// Secondary keywords carry a trailing '|', as in HLDB
+			int kw2 = !strcmp(key, "types");
+			for (; val; val = strtok_r(NULL, sep, &save)) {
+				size_t len = strlen(val);
+				char *kw = (char*) malloc(len + 2);
+				memcpy(kw, val, len);
+				kw[len] = '|';
+				kw[len + kw2] = '\0';
+				editorDefAppend(&def->keywords, &def->nkeywords, kw);
+			}
+		} else if (!strcmp(key, "comment")) {
+			free(def->scs);
+			def->scs = strdup(val);
+		} else if (!strcmp(key, "multiline")) {
+			char *end = strtok_r(NULL, sep, &save);
+			if (end == NULL) {
+				err = "multiline needs a start and an end";
+			} else {
+				free(def->mcs);
+				free(def->mce);
+				def->mcs = strdup(val);
+				def->mce = strdup(end);
+			}
+		} else if (!strcmp(key, "flags")) {
+			for (; val && !err; val = strtok_r(NULL, sep, &save)) {
+				if (!strcmp(val, "numbers")) def->flags |= HL_HIGHLIGHT_NUMBERS;
+				else if (!strcmp(val, "strings")) def->flags |= HL_HIGHLIGHT_STRINGS;
+				else err = "unknown flag";
+			}
+		} else {
+			err = "unknown key";
+		}
 	}
+	free(line);
+	fclose(fp);
 
-	free(buf);
-	// strerror() returns the error message corresponding to errno
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	if (err == NULL && def->filetype == NULL) err = "missing filetype";
+	if (err == NULL && def->nfilematch == 0) err = "missing filematch";
+
+	// Make sure the keywords fit in an editorKeywordSet
+	int pool = 0;
+	if (err == NULL && def->nkeywords * 2 > CLITE_KW_SLOTS) err = "too many keywords";
+	for (int j = 0; err == NULL && j < def->nkeywords; j++) {
+		int klen = strlen(def->keywords[j]);
+		if (def->keywords[j][klen - 1] == '|') klen--;
+		if (klen == 0 || klen > 255) err = "bad keyword length";
+		pool += klen;
+	}
+	if (err == NULL && pool > CLITE_KW_POOL) err = "too many keywords";
+	// An empty, NULL terminated keyword list
+	if (err == NULL && def->keywords == NULL) def->keywords = (char**) calloc(1, sizeof(char*));
+
+	return err;
 }
 
+// Append a string to the string section of a cache, returning its offset
+unsigned int editorCacheString(struct abuf *strings, const char *s)
+{
+	if (s == NULL) return 0;
+	unsigned int off = strings->len;
+	abAppend(strings, s, strlen(s) + 1);
+	return off;
+}
 
-/*** search ***/
+// Pad a cache section to a multiple of 8 bytes
+void editorCacheAlign(struct abuf *ab)
+{
+	static const char zero[8] = { 0 };
+	if (ab->len % 8) abAppend(ab, zero, 8 - ab->len % 8);
+}
 
-void editorFindCallback(char *query, int key)
+// Compile every syntax file into a cache image: header, sources, entries,
+// then the keyword and lexer tables and finally all strings
+void editorBuildSyntaxCache(const char *dir, editorSyntaxSource *src, int nsrc,
+		struct abuf *img)
 {
-	// Stores the last match index or -1 if none
-	static int last_match = -1;
-	// Search direction: 1 for forward, -1 for backward
-	static int direction = 1;
+	struct abuf tables, strings;
+	// Offset 0 is reserved for "not set"
+	abAppend(&strings, "", 1);
+
+	editorSyntaxCacheSource *sources = (editorSyntaxCacheSource*)
+		calloc(nsrc, sizeof(editorSyntaxCacheSource));
+	editorSyntaxCacheEntry *entries = (editorSyntaxCacheEntry*)
+		calloc(nsrc, sizeof(editorSyntaxCacheEntry));
+	int nsyntax = 0;
+
+	for (int j = 0; j < nsrc; j++) {
+		sources[j].name = editorCacheString(&strings, src[j].name);
+		sources[j].mtime = src[j].st.st_mtime;
+		sources[j].size = src[j].st.st_size;
+
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/%s", dir, src[j].name);
+		editorSyntaxDef def;
+		const char *err = editorParseSyntaxFile(path, &def);
+		if (err) {
+			editorSetStatusMessage("Syntax file %s: %s", src[j].name, err);
+			editorFreeSyntaxDef(&def);
+			continue;
+		}
 
-	// Line number where highlights need to be restored
-	static int saved_hl_line;
-	// Holds the previous highlight state for a row
-	static char *saved_hl = NULL;
+		editorSyntaxCacheEntry *e = &entries[nsyntax++];
+		e->filetype = editorCacheString(&strings, def.filetype);
+		e->scs = editorCacheString(&strings, def.scs);
+		e->mcs = editorCacheString(&strings, def.mcs);
+		e->mce = editorCacheString(&strings, def.mce);
+		e->flags = def.flags;
+
+		editorCacheAlign(&tables);
+		e->filematch = tables.len;
+		e->nfilematch = def.nfilematch;
+		for (int k = 0; k < def.nfilematch; k++) {
+			unsigned int off = editorCacheString(&strings, def.filematch[k]);
+			abAppend(&tables, (const char*) &off, sizeof(off));
+		}
 
-	// Restore previous highlight state if it exists
-	if (saved_hl) {
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-		// Free the saved memory after restoring
-		free(saved_hl);
-		// Reset the saved highlight pointer
-		saved_hl = NULL;
+		editorCacheAlign(&tables);
+		e->keywords = tables.len;
+		editorKeywordSet *set = (editorKeywordSet*) malloc(sizeof(editorKeywordSet));
+		*set = editorBuildKeywordSet(def.keywords);
+		abAppend(&tables, (const char*) set, sizeof(editorKeywordSet));
+		free(set);
+
+		struct editorSyntax syntax = { def.filetype, NULL, NULL, def.scs, def.mcs,
+			def.mce, def.flags, NULL };
+		editorCompileSyntax(&syntax);
+		editorCacheAlign(&tables);
+		e->lexer = tables.len;
+		abAppend(&tables, (const char*) syntax.lexer, sizeof(editorLexTable));
+		free((void*) syntax.lexer);
+
+		editorFreeSyntaxDef(&def);
 	}
 
-	// Exit search on Enter/Escape, else repeat search for any other key.
-	if (key == '\r' || key == '\x1b') {
-		// Reset last_match and direction to initial values as we are leaving search
-		last_match = -1;
-		direction = 1;
-		return;
-	} 
-	// Set direction to forward if right/down arrow keys are pressed
-	else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
-	}
-	// Set direction to backward if left/up arrow keys are pressed
-	else if (key == ARROW_LEFT || key == ARROW_UP) {
-		direction = -1;
-	}
-	// Reset search if any other key is pressed
-	else {
-		last_match = -1;
-		direction = 1;
+	// Turn section offsets into file offsets
+	unsigned int tables_base = sizeof(editorSyntaxCacheHeader) +
+		sizeof(editorSyntaxCacheSource) * nsrc + sizeof(editorSyntaxCacheEntry) * nsyntax;
+	unsigned int strings_base = tables_base + tables.len;
+	for (int j = 0; j < nsrc; j++) sources[j].name += strings_base;
+	for (int j = 0; j < nsyntax; j++) {
+		editorSyntaxCacheEntry *e = &entries[j];
+		unsigned int *fm = (unsigned int*) &tables.b[e->filematch];
+		for (unsigned int k = 0; k < e->nfilematch; k++) fm[k] += strings_base;
+		e->filetype += strings_base;
+		if (e->scs) e->scs += strings_base;
+		if (e->mcs) e->mcs += strings_base;
+		if (e->mce) e->mce += strings_base;
+		e->filematch += tables_base;
+		e->keywords += tables_base;
+		e->lexer += tables_base;
 	}
 
-	// If there was no previous match, search starts from the first row, forward
-	if (last_match == -1) direction = 1;
-
-	// Start search from the last match position
-	int current = last_match;
-
-	int i;
-	// Loop through all rows to search for the query
-	for (i = 0; i < E.numrows; i++) {
-		current += direction;
-
-		// Wrap around to the opposite end of the file when we reach the start/end
-		if (current == -1) current = E.numrows - 1;
-		else if (current == E.numrows) current = 0;
-
-		erow *row = &E.row[current];
-		// Check if query is found in the current row using strstr()
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			// Set cursor position to the match's location
-			E.cy = current;
-			// Set the column to the position of the match within the row by calculating
-			// the offset between the start of the row and the match pointer
-			// Then converting the match rx to cx
-			E.cx = editorRowRxToCx(row, match - row->render);
-			// Set rowoff to bottom to scroll the match to the top of the screen
-			E.rowoff = E.numrows;
+	editorSyntaxCacheHeader hdr;
+	memcpy(hdr.magic, CLITE_SYNTAX_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.kwset_size = sizeof(editorKeywordSet);
+	hdr.lexer_size = sizeof(editorLexTable);
+	hdr.nsources = nsrc;
+	hdr.nsyntax = nsyntax;
+
+	abAppend(img, (const char*) &hdr, sizeof(hdr));
+	abAppend(img, (const char*) sources, sizeof(editorSyntaxCacheSource) * nsrc);
+	abAppend(img, (const char*) entries, sizeof(editorSyntaxCacheEntry) * nsyntax);
+	abAppend(img, tables.b, tables.len);
+	abAppend(img, strings.b, strings.len);
+
+	free(sources);
+	free(entries);
+}
 
-			// Save current highlight state before modifying it
-			saved_hl_line = current;
-			saved_hl = (char*) malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			// Mark the matched substring as HL_MATCH in the `hl` array
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
+// Check a keyword table read from the cache: every keyword lies within the
+// pool and has a keyword class, and there is an empty slot to end a probe
+int editorKeywordSetValid(const editorKeywordSet *set)
+{
+	int empty = 0;
+	for (int j = 0; j < CLITE_KW_SLOTS; j++) {
+		const editorKeyword *kw = &set->slot[j];
+		if (kw->len == 0) {
+			empty = 1;
+			continue;
 		}
+		if (kw->off + kw->len > CLITE_KW_POOL || (kw->hl != HL_KEYWORD1 && kw->hl != HL_KEYWORD2))
+			return 0;
 	}
+	return empty;
 }
 
-void editorFind()
+// Check a lexer table read from the cache: every entry leads to a lexer
+// state and gives a highlight class the spans can hold
+int editorLexTableValid(const editorLexTable *lx)
 {
-	int saved_cx = E.cx;
-	int saved_cy = E.cy;
-	int saved_coloff = E.coloff;
-	int saved_rowoff = E.rowoff;
+	for (int state = 0; state < LS_STATES; state++)
+		for (int b = 0; b < 256; b++) {
+			unsigned short t = lx->t[state][b];
+			if (LEX_NEXT(t) >= LS_STATES || LEX_HL(t) > HL_NUMBER) return 0;
+		}
+	return 1;
+}
 
-	// Get the search query from the user; ESC to cancel returns NULL
-	char *query = editorPrompt((char*) "Search: %s (Use ESC/Arrows/Enter)",
-					editorFindCallback);
+// Check a cache image for consistency and against the current syntax files
+int editorSyntaxCacheValid(const char *img, size_t len, editorSyntaxSource *src, int nsrc)
+{
+	const editorSyntaxCacheHeader *hdr = (const editorSyntaxCacheHeader*) img;
+	if (len < sizeof(*hdr) || img[len - 1] != '\0') return 0;
+	if (memcmp(hdr->magic, CLITE_SYNTAX_CACHE_MAGIC, sizeof(hdr->magic)) ||
+			hdr->kwset_size != sizeof(editorKeywordSet) ||
+			hdr->lexer_size != sizeof(editorLexTable) ||
+			hdr->nsources != (unsigned int) nsrc)
+		return 0;
+	if (sizeof(*hdr) + sizeof(editorSyntaxCacheSource) * hdr->nsources +
+			sizeof(editorSyntaxCacheEntry) * hdr->nsyntax > len)
+		return 0;
 
-	if (query) {
-		free(query);
-	} else {
-		// If search is cancelled, restore the values we saved
-		E.cx = saved_cx;
-		E.cy = saved_cy;
-		E.coloff = saved_coloff;
-		E.rowoff = saved_rowoff;
+	// Any added, removed or modified syntax file invalidates the cache
+	const editorSyntaxCacheSource *sources = (const editorSyntaxCacheSource*) (hdr + 1);
+	for (int j = 0; j < nsrc; j++) {
+		if (sources[j].name >= len || strcmp(&img[sources[j].name], src[j].name) ||
+				sources[j].mtime != (long long) src[j].st.st_mtime ||
+				sources[j].size != (long long) src[j].st.st_size)
+			return 0;
 	}
-}
 
+	const editorSyntaxCacheEntry *entries = (const editorSyntaxCacheEntry*) (sources + nsrc);
+	for (unsigned int j = 0; j < hdr->nsyntax; j++) {
+		const editorSyntaxCacheEntry *e = &entries[j];
+		if (e->filetype >= len || e->scs >= len || e->mcs >= len || e->mce >= len ||
+				e->filematch + sizeof(unsigned int) * e->nfilematch > len ||
+				e->keywords + sizeof(editorKeywordSet) > len ||
+				e->lexer + sizeof(editorLexTable) > len)
+			return 0;
+		const unsigned int *fm = (const unsigned int*) &img[e->filematch];
+		for (unsigned int k = 0; k < e->nfilematch; k++)
+			if (fm[k] >= len) return 0;
+		// The tables are used as they are, so a damaged one must not get through
+		if (!editorKeywordSetValid((const editorKeywordSet*) &img[e->keywords]) ||
+				!editorLexTableValid((const editorLexTable*) &img[e->lexer]))
+			return 0;
+	}
+	return 1;
+}
 
-/*** append buffer ***/
+// Register the syntaxes of a cache image; the image must stay mapped
+void editorUseSyntaxCache(const char *img)
+{
+	const editorSyntaxCacheHeader *hdr = (const editorSyntaxCacheHeader*) img;
+	const editorSyntaxCacheEntry *entries = (const editorSyntaxCacheEntry*)
+		((const editorSyntaxCacheSource*) (hdr + 1) + hdr->nsources);
+
+	for (unsigned int j = 0; j < hdr->nsyntax; j++) {
+		const editorSyntaxCacheEntry *e = &entries[j];
+		struct editorSyntax *s = (struct editorSyntax*) malloc(sizeof(struct editorSyntax));
+		if (s == NULL) die("malloc");
+
+		const unsigned int *fm = (const unsigned int*) &img[e->filematch];
+		const char **filematch = (const char**) malloc(sizeof(char*) * (e->nfilematch + 1));
+		for (unsigned int k = 0; k < e->nfilematch; k++) filematch[k] = &img[fm[k]];
+		filematch[e->nfilematch] = NULL;
+
+		s->filetype = &img[e->filetype];
+		s->filematch = filematch;
+		s->keywords = (const editorKeywordSet*) &img[e->keywords];
+		s->singleline_comment_start = e->scs ? &img[e->scs] : NULL;
+		s->multiline_comment_start = e->mcs ? &img[e->mcs] : NULL;
+		s->multiline_comment_end = e->mce ? &img[e->mce] : NULL;
+		s->flags = e->flags;
+		s->lexer = (const editorLexTable*) &img[e->lexer];
+		editorRegisterSyntax(s);
+	}
+}
 
-// TODO: Implement the append buffer using std::string/vector if possible
-struct abuf
+// Load the syntax files, through the cache when it is up to date
+void editorLoadSyntaxFiles()
 {
-	char *b;
-	int len;
+	char dir[1024];
+	const char *env = getenv("CLITE_SYNTAX_DIR");
+	const char *home = getenv("HOME");
+	if (env) snprintf(dir, sizeof(dir), "%s", env);
+	else if (home) snprintf(dir, sizeof(dir), "%s/.clite/syntax", home);
+	else return;
+
+	editorSyntaxSource *src;
+	int nsrc = editorListSyntaxFiles(dir, &src);
+	if (nsrc == 0) return;
+
+	char path[1040];
+	snprintf(path, sizeof(path), "%s/%s", dir, CLITE_SYNTAX_CACHE);
+
+	// Fast path: map the cache compiled by an earlier run
+	const char *img = NULL;
+	int fd = open(path, O_RDONLY);
+	if (fd != -1) {
+		struct stat st;
+		if (fstat(fd, &st) != -1 && st.st_size > 0) {
+			void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				if (editorSyntaxCacheValid((const char*) map, st.st_size, src, nsrc))
+					img = (const char*) map;
+				else
+					munmap(map, st.st_size);
+			}
+		}
+		close(fd);
+	}
 
-	// Use constructor supported in C++ for struct abuf instead of defined constant
-	abuf() : b(NULL), len(0) {}
+	if (img == NULL) {
+		// Compile the syntax files and save the result for the next run; if the
+		// cache can't be written, the image is simply used from memory
+		struct abuf ab;
+		editorBuildSyntaxCache(dir, src, nsrc, &ab);
+
+		char tmp[1048];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd != -1) {
+			int ok = write(fd, ab.b, ab.len) == ab.len;
+			close(fd);
+			if (!ok || rename(tmp, path) == -1) unlink(tmp);
+		}
 
-	// Use destructor supported in C++ for struct abuf instead of function abFree()
-	~abuf()
-	{
-		free(b);
+		img = ab.b;
+		// The image stays in use for the lifetime of the editor
+		ab.b = NULL;
 	}
-};
 
-// TODO: Refactor later as member function of struct if possible
-void abAppend(struct abuf *ab, const char *s, int len)
-{
-	// Realloc to with original length + length of string to be appended
-	char *newb = (char*) realloc(ab->b, ab->len + len);
+	editorUseSyntaxCache(img);
 
-	if (newb == NULL) return;
-	// Copy the string at the end of current data in buffer
-	memcpy(&newb[ab->len], s, len);
-	// Update the pointer and length of abuf
-	ab->b = newb;
-	ab->len += len;
+	for (int j = 0; j < nsrc; j++) free(src[j].name);
+	free(src);
 }
 
 
@@ -1105,178 +3362,558 @@ void editorScroll()
 	}
 }
 
-// Handle drawing of each row of the buffer of the text being edited
-void editorDrawRows(struct abuf *ab)
+// A line of screen cells being drawn, filled from the left
+struct editorCells
 {
-	int y;
-	for (y = 0; y < E.screenrows; y++) {
-		int filerow = y + E.rowoff;
-		// Check if drawing a row within the text buffer or after its end
-		if (filerow >= E.numrows) {
-			// Display welcome message only if the text buffer is empty
-			if (E.numrows == 0 && y == E.screenrows / 3) {
-				char welcome[80];
-				// Store the message in welcome buffer by interpolating the editor version
-				int welcomelen = snprintf(welcome, sizeof(welcome), 
-						"CLiTE editor -- version %s", CLITE_VERSION);
-				// Truncate length of the string if terminal size is too small
-				if (welcomelen > E.screencols) welcomelen = E.screencols;
-				// Calculate how far from the left should the welcome message start
-				int padding = (E.screencols - welcomelen ) / 2;
-				// Print the first character as tilde ('~')
-				if (padding) {
-					abAppend(ab, "~", 1);
-					padding--;
-				}
-				// Fill the remaining space with space characters (' ')
-				while (padding--) abAppend(ab, " ", 1);
+	char *ch;
+	unsigned char *attr;
+	int len;
+	int cap;
+};
 
-				abAppend(ab, welcome, welcomelen);
-			} else {
-				abAppend(ab, "~", 1);
+// Append `n` characters with attribute `attr`, cut off at the end of the line
+void cellAppend(struct editorCells *line, const char *s, int n, int attr)
+{
+	if (n > line->cap - line->len) n = line->cap - line->len;
+	if (n <= 0) return;
+	memcpy(&line->ch[line->len], s, n);
+	memset(&line->attr[line->len], attr, n);
+	line->len += n;
+}
+
+// Append `n` copies of the character `c`
+void cellFill(struct editorCells *line, char c, int n, int attr)
+{
+	if (n > line->cap - line->len) n = line->cap - line->len;
+	if (n <= 0) return;
+	memset(&line->ch[line->len], c, n);
+	memset(&line->attr[line->len], attr, n);
+	line->len += n;
+}
+
+// Draw screen line `y` of the text being edited
+void editorDrawRow(struct editorCells *line, int y)
+{
+	int filerow = y + E.rowoff;
+	// Check if drawing a row within the text buffer or after its end
+	if (filerow >= E.numrows) {
+		// Display welcome message only if the text buffer is empty
+		if (E.numrows == 0 && y == E.screenrows / 3) {
+			char welcome[80];
+			// Store the message in welcome buffer by interpolating the editor version
+			int welcomelen = snprintf(welcome, sizeof(welcome),
+					"CLiTE editor -- version %s", CLITE_VERSION);
+			// Truncate length of the string if terminal size is too small
+			if (welcomelen > E.screencols) welcomelen = E.screencols;
+			// Calculate how far from the left should the welcome message start
+			int padding = (E.screencols - welcomelen ) / 2;
+			// Print the first character as tilde ('~')
+			if (padding) {
+				cellAppend(line, "~", 1, 0);
+				padding--;
 			}
+			// Fill the remaining space with space characters (' ')
+			cellFill(line, ' ', padding, 0);
+
+			cellAppend(line, welcome, welcomelen, 0);
 		} else {
-			// Calculate and append the visible portion of the row after column offset
-			int len = E.row[filerow].rsize - E.coloff;
-			if (len < 0) len = 0;
-			// Truncate rendered line if it exceeds the screen width
-			if (len > E.screencols) len = E.screencols;
-			// Set `c` & 'hl' to the correct part of `render` based on filerow & coloff
-			char *c = &E.row[filerow].render[E.coloff];
-			unsigned char *hl = &E.row[filerow].hl[E.coloff];
-
-			// -1 means default color (HL_NORMAL)
-			int current_color = -1;
-
-			int j;
-			for (j = 0; j < len; j++) {
-				if (iscntrl(c[j])) {
-					// Translate to printable character (alphabetic, @ (0) or ? (any other))
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					// <esc>[7m switches to inverted colors (white text on white background)
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &sym, 1);
-					// <esc>[m switches back to normal formatting (reset formatting)
-					abAppend(ab, "\x1b[m", 3);
-
-					// Restore the current color after resetting formatting
-					if (current_color != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-						abAppend(ab, buf, clen);
-					}
-				} else if (hl[j] == HL_NORMAL) {
-					// Reset to default color when switching from highlighted to normal
-					if (current_color != -1) {
-						// Escape sequence "\x1b[39m": SGR command, 39 resets to default color
-						abAppend(ab, "\x1b[39m", 5);
-						current_color = -1;
+			cellAppend(line, "~", 1, 0);
+		}
+	} else {
+		erow *row = &E.row[filerow];
+		// Walk the row's highlight spans and characters together, expanding
+		// tabs, and only draw the columns between coloff and the screen edge
+		int left = E.coloff;
+		int right = E.coloff + E.screencols;
+		int pos = 0, len, hl;
+		int cx = 0;
+
+		// The tab index gives the character on the first column shown, so
+		// nothing left of the screen is expanded
+		int start = editorRowRxToCx(row, left);
+		int rx = editorRowCxToRx(row, start);
+
+		while (rx < right && editorNextSpan(row, &pos, &len, &hl)) {
+			int end = cx + len;
+			// Skip whole spans that are left of the screen
+			if (end <= start) {
+				cx = end;
+				continue;
+			}
+			if (cx < start) cx = start;
+
+			// The whole span is drawn in one color, 0 is the default one
+			int color = (hl == HL_NORMAL) ? 0 : editorSyntaxToColor(hl) - 30;
+
+			for (; cx < end && rx < right; cx++) {
+				char c = row->chars[cx];
+				int w = (c == '\t') ? CLITE_TAB_STOP - rx % CLITE_TAB_STOP : 1;
+				// Columns of this character that are on the screen
+				int from = rx < left ? left : rx;
+				int to = rx + w > right ? right : rx + w;
+				rx += w;
+				if (from >= to) continue;
+
+				if (c == '\t') {
+					// Tabs render as spaces up to the next tab stop
+					cellFill(line, ' ', to - from, color);
+				} else if (iscntrl(c)) {
+					// Translate the run of control characters from here to printable
+					// characters (alphabetic, @ (0) or ? (any other)) shown in
+					// inverted colors
+					int n = 1;
+					while (cx + n < end && rx < right && row->chars[cx + n] != '\t' &&
+							iscntrl(row->chars[cx + n])) {
+						n++;
+						rx++;
 					}
-					abAppend(ab, &c[j], 1);
+					int at = line->len;
+					cellFill(line, '?', n, color | ATTR_INVERSE);
+					for (int j = 0; at + j < line->len; j++)
+						if (row->chars[cx + j] <= 26) line->ch[at + j] = '@' + row->chars[cx + j];
+					cx += n - 1;
 				} else {
-					// Apply color when text is highlighted
-					int color = editorSyntaxToColor(hl[j]); // Get color code
-					if (color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						// Apply new color
-						abAppend(ab, buf, clen);
+					// Append the run of plain characters from here in one go
+					int n = 1;
+					while (cx + n < end && rx < right && row->chars[cx + n] != '\t' &&
+							!iscntrl(row->chars[cx + n])) {
+						n++;
+						rx++;
 					}
-					// Append the character
-					abAppend(ab, &c[j], 1);
+					cellAppend(line, &row->chars[cx], n, color);
+					cx += n - 1;
 				}
 			}
-			// Escape sequence "\x1b[39m": SGR command, 39 resets to default color
-			abAppend(ab, "\x1b[39m", 5);
+			// Keep the character index in step if the span ran off the screen
+			cx = end;
 		}
-
-		// Erase from the cursor to the end of the current line using "\x1b[K".
-		abAppend(ab, "\x1b[K", 3);
-
-		abAppend(ab, "\r\n", 2);
 	}
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void editorDrawStatusBar(struct editorCells *line)
 {
-	// <esc>[7m switches to inverted colors (white text on white background)
-	abAppend(ab, "\x1b[7m", 4);
 	char status[80], rstatus[80];
 
 	// Display filename (or [No Name]) and line count in the status bar.
 	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
 			E.filename ? E.filename : "[No Name]", E.numrows, E.dirty ? "(modified)" : "");
 
+	// Long rows on screen are only partly highlighted, say so next to the filetype
+	const char *partial = "";
+	for (int at = E.rowoff; E.syntax && at < E.numrows && at < E.rowoff + E.screenrows; at++)
+		if (editorRowIsLong(&E.row[at])) partial = " (partial hl)";
+
 	// Display the filetype and current line number in the right status string
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-			E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+	int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d",
+			E.syntax ? E.syntax->filetype : "no ft", partial, E.cy + 1, E.numrows);
 
-	// Cut the status string short if doesn't fit inside screen width
+	// The whole bar is in inverted colors; cut the status string short if it
+	// doesn't fit inside screen width
 	if (len > E.screencols) len = E.screencols;
-	abAppend(ab, status, len);
+	cellAppend(line, status, len, ATTR_INVERSE);
 
-	while (len < E.screencols) {
-		// Pad with spaces until the right-aligned status fits, then print and exit
-		if (E.screencols - len == rlen) {
-			abAppend(ab, rstatus, rlen);
-			break;
-		} else {
-			abAppend(ab, " ", 1);
-			len++;
-		}
+	// Pad with spaces, up to the right-aligned status if it fits
+	if (E.screencols - len >= rlen) {
+		cellFill(line, ' ', E.screencols - len - rlen, ATTR_INVERSE);
+		cellAppend(line, rstatus, rlen, ATTR_INVERSE);
+	} else {
+		cellFill(line, ' ', E.screencols - len, ATTR_INVERSE);
 	}
-
-	// <esc>[m switches back to normal formatting.
-	abAppend(ab, "\x1b[m", 3);
-
-	// Add new line after status bar to make room for status msg
-	abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+void editorDrawMessageBar(struct editorCells *line)
 {
-	// Clear the message bar with the <esc>[K
-	abAppend(ab, "\x1b[K", 3);
 	int msglen = strlen(E.statusmsg);
 	// Make sure the message will fit the width of the screen
 	if (msglen > E.screencols) msglen = E.screencols;
 
 	// Display the message, but only if the message is less than 5 seconds old
 	if (msglen && time(NULL) - E.statusmsg_time < 5)
-		abAppend(ab, E.statusmsg, msglen);
+		cellAppend(line, E.statusmsg, msglen, 0);
+}
+
+// Screen model: the cells last sent to the terminal (front) and the cells of
+// the frame being drawn (back), for the text rows, the status bar and the
+// message bar. A refresh draws the whole back grid and only sends the
+// difference, after which the two are the same again
+struct editorScreen
+{
+	int rows, cols; // 0 until the next full redraw
+	int rowoff, coloff; // E.rowoff and E.coloff of the front grid
+	char *front_ch, *back_ch;
+	unsigned char *front_attr, *back_attr;
+	// Stamp of the file row on each text line, 0 for other lines. A row whose
+	// stamp is already on its line is neither drawn nor compared again
+	unsigned long *front_stamp, *back_stamp;
+	// Output of a refresh, emptied but not freed between frames, so once it has
+	// grown to the size of a full redraw frames allocate nothing
+	struct abuf frame;
+	int sent; // Bytes of `frame` the terminal has taken
+	int skipped; // A refresh was skipped while the terminal was busy
+	int fd; // Terminal, opened non-blocking, see initEditor()
+	// Whether the terminal answers status requests: 1 if it does, -1 if it
+	// didn't and 0 until known; how many are unanswered, and since when
+	int answers;
+	int unanswered;
+	long asked;
+	int sync; // The terminal supports synchronized output, mode 2026
+};
+
+struct editorScreen SC;
+
+// Forget what is on the screen, so the next refresh redraws all of it
+void editorScreenInvalidate()
+{
+	SC.rows = SC.cols = 0;
+}
+
+// Write as much of the last frame as the terminal takes without blocking;
+// returns 1 once all of it has been sent
+int editorScreenFlush()
+{
+	while (SC.sent < SC.frame.len) {
+		int n = write(SC.fd, &SC.frame.b[SC.sent], SC.frame.len - SC.sent);
+		ST.writes++;
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1 && errno == EAGAIN) return 0;
+		// Like a blocking write() before, give up on a terminal that fails
+		if (n <= 0) n = SC.frame.len - SC.sent;
+		SC.sent += n;
+	}
+	return 1;
+}
+
+// Whether the terminal is still busy with the last frame: it hasn't taken
+// all of it yet, or hasn't answered the status request sent after it. The
+// answer means the frame has made it through every buffer on the way, so
+// waiting for it keeps frames from queueing up on a slow link
+int editorScreenBusy()
+{
+	if (!editorScreenFlush()) return 1;
+	if (SC.unanswered == 0) return 0;
+	if (editorNowMs() - SC.asked >= CLITE_ACK_MS) {
+		// No answer in time; stop asking and don't wait for answers again
+		SC.answers = -1;
+		SC.unanswered = 0;
+		return 0;
+	}
+	// Frames are only held back for a terminal known to answer, so one that
+	// never does costs no waiting while that is found out
+	return SC.answers == 1;
+}
+
+// The terminal answered the status request sent after the last frame
+void editorScreenAck()
+{
+	if (SC.answers < 0) return;
+	SC.answers = 1;
+	if (SC.unanswered > 0) SC.unanswered--;
+	if (SC.unanswered > 0) SC.asked = editorNowMs();
+}
+
+// The terminal answered the mode query sent by initEditor(). States 1 to 3
+// are set, reset and permanently set, all of which mean it knows the mode
+void editorScreenModeReport(int mode, int state)
+{
+	if (mode == 2026) SC.sync = (state >= 1 && state <= 3);
+}
+
+// While waiting for a key, keep sending a frame the terminal hasn't taken
+// yet, and once it is done with it, do the refresh skipped meanwhile unless
+// keys have come in, which are handled first. Returns 1 after waiting for
+// the terminal or for input, 0 if it isn't busy or input is waiting
+int editorScreenWait()
+{
+	if (editorInputPending()) return 0;
+	if (!editorScreenBusy()) {
+		if (SC.skipped) editorRefreshScreen();
+		if (!editorScreenBusy()) return 0;
+	}
+	// The answer comes in as input, room for more output as POLLOUT
+	struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { SC.fd, POLLOUT, 0 } };
+	poll(pfd, SC.sent < SC.frame.len ? 2 : 1, CLITE_ACK_MS);
+	return 1;
+}
+
+// Block until all output has been sent and answered, before exiting, so
+// the answer doesn't end up in the shell's input
+void editorScreenDrain()
+{
+	SC.skipped = 0;
+	// Requests to a terminal that hasn't answered yet are only given a frame's
+	// time, so one that never answers doesn't hold up the exit
+	long start = editorNowMs();
+	while (editorScreenBusy() || (SC.unanswered > 0 && SC.answers == 0 &&
+		editorNowMs() - start < CLITE_FRAME_MS)) {
+		if (SC.sent < SC.frame.len) {
+			struct pollfd pfd = { SC.fd, POLLOUT, 0 };
+			poll(&pfd, 1, CLITE_ACK_MS);
+		} else if (editorInputPending()) {
+			editorReadInput();
+		} else {
+			struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+			poll(&pfd, 1, SC.answers == 1 ? CLITE_ACK_MS : CLITE_FRAME_MS);
+		}
+	}
+}
+
+// SGR sequences switching the terminal between any two cell attributes,
+// only changing what differs, e.g. "\x1b[27;39m"
+struct editorSGRTable
+{
+	char seq[32][32][8];
+	unsigned char len[32][32];
+};
+
+constexpr editorSGRTable editorBuildSGRTable()
+{
+	editorSGRTable t{};
+	for (int from = 0; from < 32; from++) {
+		for (int to = 0; to < 32; to++) {
+			if (from == to) continue;
+			char *s = t.seq[from][to];
+			int len = 0;
+			s[len++] = '\x1b';
+			s[len++] = '[';
+			if ((from ^ to) & ATTR_INVERSE) {
+				if (!(to & ATTR_INVERSE)) s[len++] = '2';
+				s[len++] = '7';
+			}
+			if (ATTR_COLOR(from) != ATTR_COLOR(to)) {
+				int color = ATTR_COLOR(to) ? 30 + ATTR_COLOR(to) : 39;
+				if (len > 2) s[len++] = ';';
+				s[len++] = '0' + color / 10;
+				s[len++] = '0' + color % 10;
+			}
+			s[len++] = 'm';
+			t.len[from][to] = len;
+		}
+	}
+	return t;
+}
+
+constexpr editorSGRTable SGR_table = editorBuildSGRTable();
+
+// Append the SGR sequence switching the terminal from attribute `from` to `to`
+inline void editorAppendSGR(struct abuf *ab, int from, int to)
+{
+	abAppend(ab, SGR_table.seq[from][to], SGR_table.len[from][to]);
+}
+
+// Append the sequence moving the cursor to column `x` of screen line `y`
+void editorAppendMove(struct abuf *ab, int y, int x)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+	abAppend(ab, buf, len);
+}
+
+// Scroll the text rows on the terminal and in the front grid by `n` lines,
+// up if `n` is positive, so rows still on screen after a vertical scroll do
+// not have to be sent again
+void editorScreenScroll(struct abuf *ab, int n)
+{
+	int rows = E.screenrows;
+	int cols = SC.cols;
+	int count = n > 0 ? n : -n;
+
+	// Limit scrolling to the text rows with DECSTBM ("\x1b[top;bottomr"), then
+	// index ("\x1bD") at the bottom or reverse index ("\x1bM") at the top
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", rows);
+	abAppend(ab, buf, len);
+	editorAppendMove(ab, n > 0 ? rows - 1 : 0, 0);
+	for (int j = 0; j < count; j++) abAppend(ab, n > 0 ? "\x1b" "D" : "\x1b" "M", 2);
+	// Reset the scroll region to the whole screen
+	abAppend(ab, "\x1b[r", 3);
+
+	// The lines scrolled in are blank
+	int keep = (rows - count) * cols;
+	int dst = n > 0 ? 0 : count * cols;
+	int src = n > 0 ? count * cols : 0;
+	int blank = n > 0 ? keep : 0;
+	memmove(&SC.front_ch[dst], &SC.front_ch[src], keep);
+	memmove(&SC.front_attr[dst], &SC.front_attr[src], keep);
+	memset(&SC.front_ch[blank], ' ', count * cols);
+	memset(&SC.front_attr[blank], 0, count * cols);
+	memmove(&SC.front_stamp[dst / cols], &SC.front_stamp[src / cols],
+			(rows - count) * sizeof(unsigned long));
+	memset(&SC.front_stamp[blank / cols], 0, count * sizeof(unsigned long));
+}
+
+// Send the cells of screen line `y` that differ from what is shown; `*attr`
+// tracks the terminal's current attribute
+void editorScreenDiffLine(struct abuf *ab, int y, int *attr)
+{
+	int cols = SC.cols;
+	char *fc = &SC.front_ch[y * cols], *bc = &SC.back_ch[y * cols];
+	unsigned char *fa = &SC.front_attr[y * cols], *ba = &SC.back_attr[y * cols];
+	if (!memcmp(fc, bc, cols) && !memcmp(fa, ba, cols)) return;
+
+	// Past its last visible cell, a line is blank
+	int fend = cols, bend = cols;
+	while (fend > 0 && fc[fend - 1] == ' ' && fa[fend - 1] == 0) fend--;
+	while (bend > 0 && bc[bend - 1] == ' ' && ba[bend - 1] == 0) bend--;
+
+	// Columns only line up with cells in plain ASCII, lines with other bytes
+	// are rewritten from their start
+	int ascii = 1;
+	for (int x = 0; x < cols && ascii; x++)
+		if ((unsigned char) (fc[x] | bc[x]) >= 0x80) ascii = 0;
+
+	// Column the terminal cursor is at on this line, -1 if it is elsewhere
+	int at = -1;
+	for (int x = 0; x < bend; x++) {
+		if (ascii && fc[x] == bc[x] && fa[x] == ba[x]) continue;
+		// Send everything up to the last changed cell that isn't followed by
+		// more than CLITE_DIFF_GAP unchanged ones, rewriting a few unchanged
+		// cells is shorter than a cursor jump
+		int end = x + 1;
+		for (int next = end; next < bend && next - end <= CLITE_DIFF_GAP; next++)
+			if (!ascii || fc[next] != bc[next] || fa[next] != ba[next]) end = next + 1;
+
+		editorAppendMove(ab, y, x);
+		// Append each run of cells with the same attribute in one go
+		while (x < end) {
+			int run = x + 1;
+			while (run < end && ba[run] == ba[x]) run++;
+			if (ba[x] != *attr) {
+				editorAppendSGR(ab, *attr, ba[x]);
+				*attr = ba[x];
+			}
+			abAppend(ab, &bc[x], run - x);
+			x = run;
+		}
+		at = end;
+		x = end - 1;
+	}
+
+	// Erase whatever the line showed past its new end
+	if (fend > bend || (!ascii && bend < cols)) {
+		if (at != bend) editorAppendMove(ab, y, bend);
+		if (*attr != 0) {
+			editorAppendSGR(ab, *attr, 0);
+			*attr = 0;
+		}
+		abAppend(ab, "\x1b[K", 3);
+	}
+
+	memcpy(fc, bc, cols);
+	memcpy(fa, ba, cols);
 }
 
 void editorRefreshScreen()
 {
 	editorScroll();
+	// Bring highlighting of every visible row up to date before drawing
+	editorSyntaxCatchUp(E.rowoff + E.screenrows - 1);
+	editorSyntaxFollowColumns();
+
+	// While the terminal is still busy with the last frame, skip this one. The
+	// refresh done once it is sends the difference to the latest state, so the
+	// frames in between are dropped instead of queueing up
+	if (editorScreenBusy()) {
+		SC.skipped = 1;
+		ST.frames_skipped++;
+		return;
+	}
+	SC.skipped = 0;
 
-	struct abuf ab;
+	struct abuf *ab = &SC.frame;
+	ab->len = 0;
+	SC.sent = 0;
+	ST.frames++;
 
 	// Escape sequences start with \x1b, followed by [ and an argument
 	// before the command
 
-	// Hide the cursor with "\x1b[?25l"
-	abAppend(&ab, "\x1b[?25l", 6);
-	// Write \x1b[H to position the cursor at top-left (1,1), default for 'H'
-	abAppend(&ab, "\x1b[H", 3);
+	// Where supported, the terminal holds off repainting until the whole frame
+	// is in, between "\x1b[?2026h" and "\x1b[?2026l"
+	if (SC.sync) abAppend(ab, "\x1b[?2026h", 8);
+
+	// Hide the cursor with "\x1b[?25l" while the screen is changed
+	abAppend(ab, "\x1b[?25l", 6);
+	int start = ab->len;
+
+	int rows = E.screenrows + 2;
+	int cols = E.screencols;
+	if (SC.rows != rows || SC.cols != cols) {
+		int cells = rows * cols;
+		SC.front_ch = (char*) realloc(SC.front_ch, cells);
+		SC.back_ch = (char*) realloc(SC.back_ch, cells);
+		SC.front_attr = (unsigned char*) realloc(SC.front_attr, cells);
+		SC.back_attr = (unsigned char*) realloc(SC.back_attr, cells);
+		SC.front_stamp = (unsigned long*) realloc(SC.front_stamp, rows * sizeof(unsigned long));
+		SC.back_stamp = (unsigned long*) realloc(SC.back_stamp, rows * sizeof(unsigned long));
+		if (!SC.front_ch || !SC.back_ch || !SC.front_attr || !SC.back_attr ||
+				!SC.front_stamp || !SC.back_stamp) die("realloc");
+		SC.rows = rows;
+		SC.cols = cols;
+
+		// Start from a cleared screen, "\x1b[2J", with default attributes
+		abAppend(ab, "\x1b[m\x1b[2J", 7);
+		memset(SC.front_ch, ' ', cells);
+		memset(SC.front_attr, 0, cells);
+		memset(SC.front_stamp, 0, rows * sizeof(unsigned long));
+		SC.rowoff = E.rowoff;
+		SC.coloff = E.coloff;
+	}
+
+	// Every row draws differently after a horizontal scroll
+	if (SC.coloff != E.coloff) {
+		memset(SC.front_stamp, 0, rows * sizeof(unsigned long));
+		SC.coloff = E.coloff;
+	}
 
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
+	// Shift what is on the screen along with a vertical scroll
+	int scroll = E.rowoff - SC.rowoff;
+	if (scroll != 0 && scroll > -E.screenrows && scroll < E.screenrows)
+		editorScreenScroll(ab, scroll);
+	SC.rowoff = E.rowoff;
 
-	char buf[32];
-	// Modified H command to move cursor to (1-indexed) position
-	// Adjust cursor on screen by subtracting E.rowoff, as E.cy is now file pos
-	// Adjust cursor on screen by subtracting E.coloff, as E.cx is now file pos
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-	abAppend(&ab, buf, strlen(buf));
+	// Draw the frame into the back grid, blank past what each line draws
+	for (int y = 0; y < rows; y++) {
+		int filerow = y + E.rowoff;
+		SC.back_stamp[y] = (y < E.screenrows && filerow < E.numrows) ? E.row[filerow].stamp : 0;
+		if (SC.back_stamp[y] != 0 && SC.back_stamp[y] == SC.front_stamp[y]) continue;
+
+		struct editorCells line = { &SC.back_ch[y * cols], &SC.back_attr[y * cols], 0, cols };
+		if (y < E.screenrows) editorDrawRow(&line, y);
+		else if (y == E.screenrows) editorDrawStatusBar(&line);
+		else editorDrawMessageBar(&line);
+		cellFill(&line, ' ', cols - line.len, 0);
+	}
+
+	// Each frame starts and ends with default attributes
+	int attr = 0;
+	for (int y = 0; y < rows; y++) {
+		if (SC.back_stamp[y] != 0 && SC.back_stamp[y] == SC.front_stamp[y]) continue;
+		editorScreenDiffLine(ab, y, &attr);
+		SC.front_stamp[y] = SC.back_stamp[y];
+	}
+	if (attr != 0) editorAppendSGR(ab, attr, 0);
+
+	// Nothing but the cursor position is sent when no cell changed
+	int hidden = ab->len > start;
+	if (!hidden) ab->len = 0;
+
+	// Move the cursor to its position on the screen, relative to E.rowoff and
+	// E.coloff as E.cy and E.rx are positions in the file
+	editorAppendMove(ab, E.cy - E.rowoff, E.rx - E.coloff);
 
 	// Show the cursor with "\x1b[?25h"
-	abAppend(&ab, "\x1b[?25h", 6);
+	if (hidden) abAppend(ab, "\x1b[?25h", 6);
+	if (hidden && SC.sync) abAppend(ab, "\x1b[?2026l", 8);
 
-	// Write the contents of append buffer to screen once
-	write(STDOUT_FILENO, ab.b, ab.len);
+	// Follow a frame that changed the screen with a status request, "\x1b[5n"
+	if (hidden && SC.answers >= 0) {
+		abAppend(ab, "\x1b[5n", 4);
+		if (SC.unanswered++ == 0) SC.asked = editorNowMs();
+	}
+
+	// Send the frame in one write(), or as much of it as the terminal takes for
+	// now with the rest following as it makes room
+	editorScreenFlush();
 }
 
 void editorSetStatusMessage(const char *fmt, ...)
@@ -1289,6 +3926,15 @@ void editorSetStatusMessage(const char *fmt, ...)
 	E.statusmsg_time = time(NULL);
 }
 
+// Show the performance counters in the message bar
+void editorShowStats()
+{
+	unsigned long lookups = ST.hl_cache_hits + ST.hl_cache_misses;
+	editorSetStatusMessage("Stats: hl %lu/%lu hits (%lu%%) | %lu frames, %lu skipped, %lu writes, %lu allocs",
+			ST.hl_cache_hits, lookups, lookups ? ST.hl_cache_hits * 100 / lookups : 0,
+			ST.frames, ST.frames_skipped, ST.writes, ST.ab_allocs);
+}
+
 
 /*** input ***/
 
@@ -1330,6 +3976,22 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
 				return buf;
 			}
 		}
+		// Append the printable characters of pasted text to the buffer
+		else if (c == PASTE_START) {
+			int len;
+			char *text = editorReadPaste(&len);
+			for (int i = 0; i < len; i++) {
+				if (iscntrl((unsigned char) text[i]) || (unsigned char) text[i] >= 128) continue;
+				if (buflen == bufsize - 1) {
+					bufsize *= 2;
+					buf = (char*) realloc(buf, bufsize);
+					if (buf == NULL) die("realloc");
+				}
+				buf[buflen++] = text[i];
+			}
+			buf[buflen] = '\0';
+			free(text);
+		}
 		// If a printable character is pressed, append it to the buffer
 		else if (!iscntrl(c) && c < 128) {
 			// Ensure the buffer has enough space, realloc if necessary
@@ -1414,6 +4076,7 @@ void editorProcessKeypress()
 				return;
 			}
 			// Clear the screen and reposition the cursor on exit
+			editorScreenDrain();
 			write(STDOUT_FILENO, "\x1b[2J", 4);
 			write(STDOUT_FILENO, "\x1b[H", 3);
 			exit(0);
@@ -1438,6 +4101,21 @@ void editorProcessKeypress()
 			editorFind();
 			break;
 
+		// Handle Ctrl+B to jump to the matching bracket
+		case CTRL_KEY('b'):
+			editorMatchBracket();
+			break;
+
+		// Handle Ctrl+E to jump to the start of the enclosing block
+		case CTRL_KEY('e'):
+			editorEnclosingBlock();
+			break;
+
+		// Handle Ctrl+T to show the performance counters
+		case CTRL_KEY('t'):
+			editorShowStats();
+			break;
+
 
 		// Handle Backspace (127), Ctrl-H (8) (Old Backspace), and Delete (ESC[3~)
 		case BACKSPACE:
@@ -1473,8 +4151,16 @@ void editorProcessKeypress()
 			editorMoveCursor(c);
 			break;
 
-		// Ignore Ctrl-L and Esc; screen already refreshes, and Esc avoids unwanted input
+		// Ctrl-L redraws the whole screen, in case something else wrote to it
 		case CTRL_KEY('l'):
+			editorScreenInvalidate();
+			break;
+
+		case PASTE_START:
+			editorPaste();
+			break;
+
+		// Ignore Esc to avoid unwanted input
 		case '\x1b':
 			break;
 
@@ -1499,16 +4185,44 @@ void initEditor()
 	E.numrows = 0;
 	E.row = NULL;
 	E.dirty = 0;
+	E.hl_valid = 0;
+	E.hl_stale_end = 0;
+	// Use every online CPU for highlighting large files
+	E.hl_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (E.hl_threads < 1) E.hl_threads = 1;
+	if (E.hl_threads > CLITE_HL_MAX_THREADS) E.hl_threads = CLITE_HL_MAX_THREADS;
+	// Threshold for degraded highlighting of long rows, in characters
+	const char *long_row = getenv("CLITE_LONG_ROW");
+	E.long_row = long_row ? atoi(long_row) : 0;
+	if (E.long_row <= 0) E.long_row = CLITE_LONG_ROW;
 	E.filename = NULL;
 	// E.statusmsg is empty string, so no message displayed by default
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 	E.syntax = NULL;
 
+	// Compile the lexer tables of the built-in syntaxes and make them available
+	// for file type lookup, followed by the ones from syntax files
+	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+		editorCompileSyntax(&HLDB[j]);
+		editorRegisterSyntax(&HLDB[j]);
+	}
+	editorLoadSyntaxFiles();
+
+	// Frames are written through a descriptor of the terminal's own, since
+	// making stdout non-blocking would make stdin non-blocking as well
+	const char *tty = ttyname(STDOUT_FILENO);
+	SC.fd = tty ? open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY) : -1;
+	if (SC.fd == -1) SC.fd = STDOUT_FILENO;
 
 	if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
 	// Decrement E.screenrows to make room for status bar and status msg
 	E.screenrows -= 2;
+
+	// Ask whether the terminal supports synchronized output with "\x1b[?2026$p";
+	// the answer is taken in with the keys, and frames are sent without it
+	// until then
+	write(STDOUT_FILENO, "\x1b[?2026$p", 10);
 }
 
 int main(int argc, char *argv[])
@@ -1519,11 +4233,23 @@ int main(int argc, char *argv[])
 		editorOpen(argv[1]);
 	}
 
-	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+	// Show help unless there is already something to report (e.g., a bad syntax file)
+	if (E.statusmsg[0] == '\0')
+		editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
 
 	while (1) {
 		editorRefreshScreen();
+		// Handle every key that has already arrived before refreshing again, so
+		// a paste or key repeat costs one refresh rather than one per key; a long
+		// burst still refreshes every CLITE_FRAME_MS so the screen keeps up
+		long frame = editorNowMs();
 		editorProcessKeypress();
+		while (editorKeyPending() && editorNowMs() - frame < CLITE_FRAME_MS) {
+			// Keys such as Page Up/Down act on the scroll position a refresh
+			// would have shown
+			editorScroll();
+			editorProcessKeypress();
+		}
 	}
 	return 0;
 }